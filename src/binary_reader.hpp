@@ -0,0 +1,128 @@
+#ifndef UUID_5D4E1B36_8E0B_4F5B_9C6A_2B7A0F3E91C4
+#define UUID_5D4E1B36_8E0B_4F5B_9C6A_2B7A0F3E91C4
+#pragma once
+
+#include "endian.hpp"
+#include "source.hpp"
+
+#include <libshit/check.hpp>
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace Neptools
+{
+
+  /// Cursor over a range of a Source for parsing tables. The range is bounds
+  /// checked and fetched once on construction: without copying when the
+  /// source has stable chunks (Source::HasStableChunks) and the range is
+  /// contiguous in its memory, into fallback otherwise. Loads after that only
+  /// check with a throwing Checker (like Source::Read), and report errors with
+  /// the same infos as Source.
+  class BinaryReader
+  {
+  public:
+    /// Throws SourceOverflow if [offs, offs+len) is not inside src. src and
+    /// fallback must outlive the reader, and fallback must not be modified or
+    /// given to another reader while this one is used. Other reads of src
+    /// (or of any source sharing its provider) are allowed in the meantime,
+    /// they can't invalidate the reader's data.
+    BinaryReader(const Source& src, FilePosition offs, FileMemSize len,
+                 std::string& fallback)
+      : src{&src}, base{offs},
+        data{src.GetContiguous<Libshit::Check::Throw>(offs, len, fallback)}
+    {
+      // a view into an LRU chunk dies when the next read evicts the chunk
+      if (!src.HasStableChunks() && data.data() != fallback.data())
+        data = fallback.assign(data);
+    }
+
+    /// Position in the source
+    FilePosition Tell() const noexcept { return base + pos; }
+    FileMemSize GetSize() const noexcept { return data.size(); }
+    FileMemSize GetRemainingSize() const noexcept { return data.size() - pos; }
+    bool Eof() const noexcept { return pos == data.size(); }
+
+    /// Seek to a position in the source (must be inside the reader's range)
+    template <typename Checker = Libshit::Check::Assert>
+    void Seek(FilePosition offs)
+    {
+      LIBSHIT_ADD_INFOS(
+        LIBSHIT_CHECK(SourceOverflow, offs >= base && offs - base <= data.size(),
+                      "Seek outside of reader");
+        pos = offs - base,
+        "Used source", *src, "Seek offset", offs);
+    }
+    template <typename Checker = Libshit::Check::Assert>
+    void Skip(FileMemSize len) { Check<Checker>(len); pos += len; }
+
+    template <typename Checker = Libshit::Check::Assert>
+    void Read(Byte* buf, FileMemSize len)
+    {
+      Check<Checker>(len);
+      memcpy(buf, data.data() + pos, len);
+      pos += len;
+    }
+    template <typename Checker = Libshit::Check::Assert>
+    void Read(char* buf, FileMemSize len)
+    { Read<Checker>(reinterpret_cast<Byte*>(buf), len); }
+
+    template <typename Checker = Libshit::Check::Assert, typename T>
+    void ReadGen(T& x)
+    { Read<Checker>(reinterpret_cast<Byte*>(&x), Libshit::EmptySizeof<T>); }
+    template <typename T, typename Checker = Libshit::Check::Assert>
+    T ReadGen() { T ret; ReadGen<Checker>(ret); return ret; }
+
+    /// Zero copy view of the next len bytes, valid as long as the reader.
+    template <typename Checker = Libshit::Check::Assert>
+    std::string_view ReadView(FileMemSize len)
+    {
+      Check<Checker>(len);
+      auto ret = data.substr(pos, len);
+      pos += len;
+      return ret;
+    }
+
+#define NEPTOOLS_GEN_HLP2(bits, Camel, snake)                             \
+    template <typename Checker = Libshit::Check::Assert>                  \
+    std::uint##bits##_t Read##Camel##Uint##bits()                         \
+    {                                                                     \
+      return boost::endian::snake##_to_native(                            \
+        ReadGen<std::uint##bits##_t, Checker>());                         \
+    }
+#define NEPTOOLS_GEN_HLP(bits)                                           \
+    template <typename Checker = Libshit::Check::Assert>                 \
+    std::uint##bits##_t ReadUint##bits(Endian e)                         \
+    {                                                                    \
+      return ToNativeCopy(ReadGen<std::uint##bits##_t, Checker>(), e);   \
+    }                                                                    \
+    NEPTOOLS_GEN_HLP2(bits, Little, little)                              \
+    NEPTOOLS_GEN_HLP2(bits, Big, big)
+
+    NEPTOOLS_GEN_HLP(8)
+    NEPTOOLS_GEN_HLP(16)
+    NEPTOOLS_GEN_HLP(32)
+    NEPTOOLS_GEN_HLP(64)
+#undef NEPTOOLS_GEN_HLP
+#undef NEPTOOLS_GEN_HLP2
+
+  private:
+    template <typename Checker>
+    void Check(FileMemSize len) const
+    {
+      LIBSHIT_ADD_INFOS(
+        LIBSHIT_CHECK(SourceOverflow, len <= data.size() - pos,
+                      "Source overflow"),
+        "Used source", *src, "Read offset", Tell(), "Read size", len);
+    }
+
+    const Source* src;
+    FilePosition base;
+    std::string_view data;
+    FileMemSize pos = 0;
+  };
+
+}
+
+#endif
@@ -23,6 +23,9 @@ namespace Libshit::Lua
       static_cast<void (::Neptools::Dumpable::*)(::Neptools::Sink &) const>(&::Neptools::Dumpable::Dump),
       static_cast<void (::Neptools::Dumpable::*)(const ::boost::filesystem::path &) const>(&::Neptools::Dumpable::Dump)
     >("dump");
+    bld.AddFunction<
+      static_cast<void (::Neptools::Dumpable::*)(::Neptools::Sink &)>(&::Neptools::Dumpable::DumpStream)
+    >("dump_stream");
     bld.AddFunction<
       static_cast<void (::Neptools::Dumpable::*)(const ::boost::filesystem::path &) const>(&::Neptools::Dumpable::Inspect),
       static_cast<std::string (::Neptools::Dumpable::*)() const>(&::Neptools::Dumpable::Inspect)
@@ -1,11 +1,32 @@
 #include "dumpable.hpp"
 
 #include "sink.hpp"
+#include "source.hpp"
+#include "zstd.hpp"
 
 #include <libshit/platform.hpp>
 
 #include <boost/filesystem/operations.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <system_error>
+#include <thread>
+
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#include <libshit/doctest.hpp>
 
 #if LIBSHIT_OS_IS_WINDOWS
 #  include <vector>
@@ -35,24 +56,206 @@ namespace
 
 namespace Neptools
 {
+  TEST_SUITE_BEGIN("Neptools::Dumpable");
 
   Libshit::NotNullSharedPtr<TxtSerializable>
   Dumpable::GetDefaultTxtSerializable(
     const Libshit::NotNullSharedPtr<Dumpable>& thiz)
   { LIBSHIT_THROW(Libshit::DecodeError, "Not txt-serializable file"); }
 
+  namespace
+  {
+    // Compares the output with the existing file. Only starts writing (into
+    // the sink returned by open) at the first difference, copying the equal
+    // part from the old file.
+    class CompareSink final : public Sink
+    {
+    public:
+      using Open = std::function<Libshit::NotNull<Libshit::RefCountedPtr<Sink>>()>;
+      CompareSink(Source old, Open open)
+        : Sink{old.GetSize()}, old{Libshit::Move(old)}, open{Libshit::Move(open)}
+      {
+        Sink::buf = buf;
+        buf_size = MEM_CHUNK;
+      }
+
+      void Finish() override
+      {
+        Flush();
+        if (out) out->Finish();
+        out.reset(); // close it before it's renamed
+      }
+
+      // whether the output differed (and was written)
+      bool IsChanged() const noexcept { return changed; }
+
+      void Flush() override
+      {
+        Put(buf, buf_put);
+        buf_put = 0;
+        if (out) out->Flush();
+      }
+
+    private:
+      void Write_(std::string_view data) override
+      {
+        Flush();
+        if (data.size() >= MEM_CHUNK)
+          Put(reinterpret_cast<const Byte*>(data.data()), data.size());
+        else
+        {
+          memcpy(buf, data.data(), data.size());
+          buf_put = data.size();
+        }
+      }
+
+      void Pad_(FileMemSize len) override
+      {
+        Flush();
+        for (auto pos = offset; !out && pos < offset + len; )
+        {
+          auto chunk = old.GetChunk(pos);
+          chunk = chunk.substr(0, offset + len - pos);
+          if (std::any_of(chunk.begin(), chunk.end(), [](char c) { return c != 0; }))
+            Diverge();
+          pos += chunk.size();
+        }
+        if (out) out->Pad(len);
+        offset += len;
+      }
+
+      void Put(const Byte* ptr, FileMemSize len)
+      {
+        for (auto pos = offset; !out && pos < offset + len; )
+        {
+          auto chunk = old.GetChunk(pos);
+          auto n = std::min<FileMemSize>(chunk.size(), offset + len - pos);
+          if (memcmp(chunk.data(), ptr + (pos - offset), n)) Diverge();
+          pos += n;
+        }
+        if (out) out->Write({reinterpret_cast<const char*>(ptr), len});
+        offset += len;
+      }
+
+      void Diverge()
+      {
+        out = open();
+        changed = true;
+        Source{old, 0, offset}.Dump(*out);
+      }
+
+      Source old;
+      Open open;
+      Libshit::RefCountedPtr<Sink> out;
+      bool changed = false;
+      Byte buf[MEM_CHUNK];
+    };
+  }
+
+#ifdef O_TMPFILE
+  namespace
+  {
+    // Unnamed file in the directory of path, only linked in when complete:
+    // no half written files with random names after a crash. Not
+    // preallocated: padding only skips, leaving holes in the file.
+    struct TmpFile
+    {
+      TmpFile(const boost::filesystem::path& path)
+      {
+        auto dir = path.parent_path();
+        fd = ::open(dir.empty() ? "." : dir.c_str(),
+                  O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+      }
+      ~TmpFile() noexcept { if (fd != -1) close(fd); }
+      TmpFile(const TmpFile&) = delete;
+      void operator=(const TmpFile&) = delete;
+
+      // false if to already exists
+      bool Link(const char* to)
+      {
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, to, AT_SYMLINK_FOLLOW) == 0)
+          return true;
+        if (errno == EEXIST) return false;
+        // no /proc, this one needs CAP_DAC_READ_SEARCH
+        if (linkat(fd, "", AT_FDCWD, to, AT_EMPTY_PATH) == 0) return true;
+        if (errno == EEXIST) return false;
+        LIBSHIT_THROW_ERRNO("linkat");
+      }
+
+      void LinkOver(const boost::filesystem::path& path)
+      {
+        if (Link(path.c_str())) return;
+        // linkat doesn't replace, link with a temporary name and rename that
+        auto path2 = path;
+        path2 += boost::filesystem::unique_path();
+        if (!Link(path2.c_str()))
+          LIBSHIT_THROW(std::runtime_error, "Temporary file already exists",
+                        "File name", path2.string());
+        boost::filesystem::rename(path2, path);
+      }
+
+      int fd;
+    };
+  }
+#endif
+
+  static std::atomic<std::size_t> unchanged_dumps{0};
+  std::size_t GetUnchangedDumpCount() noexcept { return unchanged_dumps; }
+
   void Dumpable::Dump(const boost::filesystem::path& path) const
   {
+    auto size = GetSize();
+    // the compressed size is only known at the end
+    auto zst = IsZstdPath(path);
+    auto out_size = zst ? Sink::UNKNOWN_SIZE : size;
+    // sinks only log errors in their destructors, finish them explicitly so
+    // a failed write doesn't replace the file
+    auto dump = [&](Sink& sink) { Dump(sink); sink.Finish(); };
 #if LIBSHIT_OS_IS_VITA
     // no unique_path on vita
-    Dump(*Sink::ToFile(path, GetSize()));
+    if (zst) dump(*CompressZstd(Sink::ToFile(path, out_size), size));
+    else dump(*Sink::ToFile(path, size));
 #else
-    auto path2 = path;
+    boost::filesystem::path path2; // when not writing an unnamed file
+#ifdef O_TMPFILE
+    std::optional<TmpFile> tmp;
+#endif
+    // except on windows, a non mmap sink uses writev, writing unchanged
+    // parts directly from the input mappings
+    auto open = [&]() -> Libshit::NotNull<Libshit::RefCountedPtr<Sink>>
+    {
+#ifdef O_TMPFILE
+      tmp.emplace(path);
+      if (tmp->fd != -1)
+        return Sink::ToFd(path, tmp->fd, false, out_size, false);
+#endif
+      path2 = path;
+      path2 += boost::filesystem::unique_path();
+      return Sink::ToFile(path2, out_size, LIBSHIT_OS_IS_WINDOWS);
+    };
+
+    boost::system::error_code ec;
+    if (zst)
+      dump(*CompressZstd(open(), size));
+    else if (GetIoSettings().write_if_changed &&
+             boost::filesystem::file_size(path, ec) == size && !ec)
     {
-      auto sink = Sink::ToFile(path2+=boost::filesystem::unique_path(), GetSize());
-      Dump(*sink);
+      CompareSink cmp{Source::FromFile(path), open};
+      dump(cmp);
+      if (!cmp.IsChanged())
+      {
+        ++unchanged_dumps;
+        return;
+      }
     }
+    else
+      dump(*open());
 
+#ifdef O_TMPFILE
+    if (tmp->fd != -1) return tmp->LinkOver(path);
+#endif
 #if LIBSHIT_OS_IS_WINDOWS
     if (LIBSHIT_OS_IS_WINDOWS && boost::filesystem::is_regular_file(path))
     {
@@ -66,6 +269,144 @@ namespace Neptools
 #endif
   }
 
+  // not worth starting threads below this
+  static constexpr FilePosition PARALLEL_MIN_SIZE = MMAP_LIMIT;
+  // workers don't start more workers
+  static thread_local bool in_parallel_dump = false;
+
+  void Dumpable::DumpParts(
+    Sink& sink, FilePosition size, const std::vector<Part>& parts)
+  {
+    auto jobs = GetIoSettings().dump_jobs;
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<std::size_t>(jobs, parts.size());
+
+    std::vector<Libshit::RefCountedPtr<Sink>> subs;
+    if (jobs > 1 && size >= PARALLEL_MIN_SIZE && !in_parallel_dump &&
+        std::all_of(parts.begin(), parts.end(),
+                    [](auto& p) { return p.dmp->CanDumpParallel(); }))
+    {
+      auto start = sink.Tell();
+      subs.reserve(parts.size());
+      for (auto& p : parts)
+      {
+        subs.push_back(sink.SubSink(start + p.offset, p.dmp->GetSize()));
+        if (!subs.back()) { subs.clear(); break; }
+      }
+    }
+
+    if (subs.empty())
+    {
+      FilePosition pos = 0;
+      for (auto& p : parts)
+      {
+        LIBSHIT_ASSERT(p.offset >= pos);
+        sink.Pad(p.offset - pos);
+        p.dmp->Dump(sink);
+        pos = p.offset + p.dmp->GetSize();
+      }
+      LIBSHIT_ASSERT(pos <= size);
+      sink.Pad(size - pos);
+      return;
+    }
+
+    // the parts are written by the sub sinks, skip them here
+    sink.Pad(size);
+    sink.Flush();
+
+    // only switch the sources once it's sure the dump is parallel, and
+    // switch them back after it
+    struct ThreadSafeScope
+    {
+      const std::vector<Part>& parts;
+      explicit ThreadSafeScope(const std::vector<Part>& parts) noexcept
+        : parts{parts} { for (auto& p : parts) p.dmp->SetThreadSafe(true); }
+      ~ThreadSafeScope() { for (auto& p : parts) p.dmp->SetThreadSafe(false); }
+    } thread_safe{parts};
+
+    std::atomic<std::size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]()
+    {
+      in_parallel_dump = true;
+      for (std::size_t i; (i = next++) < parts.size(); )
+      {
+        try
+        {
+          parts[i].dmp->Dump(*subs[i]);
+          subs[i]->Flush();
+        }
+        catch (...)
+        {
+          std::lock_guard lock{error_mutex};
+          if (!error) error = std::current_exception();
+          next = parts.size();
+        }
+      }
+      in_parallel_dump = false;
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(jobs - 1);
+    try { while (threads.size() < jobs - 1) threads.emplace_back(worker); }
+    catch (const std::system_error&) {} // continue with less threads
+    worker();
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+  }
+
+  TEST_CASE("dump to file")
+  {
+    boost::filesystem::remove("tmp");
+    std::string data(2*MEM_CHUNK, 'x');
+    DumpableSource{Source::FromMemory(data)}.Dump("tmp");
+    auto src = Source::FromFile("tmp");
+    CHECK(src.GetSize() == data.size());
+
+    // replace, while the old version is still open
+    DumpableSource{Source::FromMemory("foo")}.Dump("tmp");
+    std::string act(3, '\0');
+    Source::FromFile("tmp").Pread(0, act.data(), 3);
+    CHECK(act == "foo");
+    CHECK(src.GetSize() == data.size());
+  }
+
+  TEST_CASE("write if changed")
+  {
+    auto& setting = GetIoSettings().write_if_changed;
+    auto old_setting = setting;
+    setting = true;
+    auto dump = [](std::string str)
+    { DumpableSource{Source::FromMemory(Libshit::Move(str))}.Dump("tmp"); };
+    auto read = []()
+    {
+      auto src = Source::FromFile("tmp");
+      std::string ret(src.GetSize(), '\0');
+      src.Pread(0, ret.data(), ret.size());
+      return ret;
+    };
+
+    std::string data(3*MEM_CHUNK, 'a');
+    data[MEM_CHUNK] = 0;
+    dump(data);
+    auto count = GetUnchangedDumpCount();
+    dump(data);
+    CHECK(GetUnchangedDumpCount() == count + 1);
+    CHECK(read() == data);
+
+    // difference after a prefix that must be copied from the old file
+    data[2*MEM_CHUNK + 5] = 'b';
+    dump(data);
+    CHECK(GetUnchangedDumpCount() == count + 1);
+    CHECK(read() == data);
+
+    data.resize(10);
+    dump(data);
+    CHECK(read() == data);
+    setting = old_setting;
+  }
+
   void Dumpable::Inspect(const boost::filesystem::path& path) const
   {
     return Inspect(OpenOut(path));
@@ -92,6 +433,7 @@ namespace Neptools
     return ss.str();
   }
 
+  TEST_SUITE_END();
 }
 
 #include "dumpable.binding.hpp"
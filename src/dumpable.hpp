@@ -11,6 +11,8 @@
 
 #include <boost/filesystem/path.hpp>
 
+#include <vector>
+
 namespace Neptools
 {
 
@@ -29,6 +31,13 @@ namespace Neptools
     virtual void Fixup() {};
     virtual FilePosition GetSize() const = 0;
 
+    /// Whether this can be dumped in parallel with other dumpables reading
+    /// the same sources, after SetThreadSafe(true).
+    LIBSHIT_NOLUA virtual bool CanDumpParallel() const { return false; }
+    /// Prepare for being dumped in parallel (on = true), or undo it (false).
+    /// Only called if CanDumpParallel, see Source::Provider::SetThreadSafe.
+    LIBSHIT_NOLUA virtual void SetThreadSafe(bool) const noexcept {}
+
     LIBSHIT_NOLUA
     virtual Libshit::NotNullSharedPtr<TxtSerializable>
     GetDefaultTxtSerializable(const Libshit::NotNullSharedPtr<Dumpable>& thiz);
@@ -38,6 +47,13 @@ namespace Neptools
     void Dump(Sink&& os) const { return Dump_(os); }
     void Dump(const boost::filesystem::path& path) const;
 
+    /// Dump in one pass without needing the size in advance (sinks of
+    /// Sink::UNKNOWN_SIZE). Types that can't do this Fixup and Dump. Leaves
+    /// the object fixed up.
+    void DumpStream(Sink& os) { return DumpStream_(os); }
+    LIBSHIT_NOLUA
+    void DumpStream(Sink&& os) { return DumpStream_(os); }
+
     LIBSHIT_NOLUA
     void Inspect(std::ostream& os, unsigned indent = 0) const
     { return Inspect_(os, indent); }
@@ -50,13 +66,29 @@ namespace Neptools
   protected:
     static std::ostream& Indent(std::ostream& os, unsigned indent);
 
+    struct Part
+    {
+      FilePosition offset; // relative to the start of the parts
+      const Dumpable* dmp;
+    };
+    /// Dump parts (sorted by offset, not overlapping) and zero fill the rest
+    /// of size bytes. Parts are dumped in parallel into sub sinks when the
+    /// sink and the parts support it (see IoSettings::dump_jobs).
+    static void DumpParts(
+      Sink& sink, FilePosition size, const std::vector<Part>& parts);
+
   private:
     virtual void Dump_(Sink& sink) const = 0;
+    virtual void DumpStream_(Sink& sink) { Fixup(); Dump_(sink); }
     virtual void Inspect_(std::ostream& os, unsigned indent) const = 0;
   };
 
   std::ostream& operator<<(std::ostream& os, const Dumpable& dmp);
 
+  /// Number of Dump(path) calls that didn't write the file because it was
+  /// unchanged (see IoSettings::write_if_changed).
+  std::size_t GetUnchangedDumpCount() noexcept;
+
   inline Libshit::Lua::DynamicObject& GetDynamicObject(Dumpable& d) { return d; }
 
 }
@@ -0,0 +1,161 @@
+#include "arena.hpp"
+
+#include <libshit/assert.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <new>
+
+#include <libshit/doctest.hpp>
+
+namespace Neptools
+{
+  TEST_SUITE_BEGIN("Neptools::Arena");
+
+  thread_local Arena* Arena::current = nullptr;
+
+  namespace
+  {
+    // before every allocation, keeps the GRANULARITY alignment
+    struct alignas(Arena::GRANULARITY) Header { Arena* arena; };
+    static_assert(sizeof(Header) == Arena::GRANULARITY);
+    static_assert(alignof(std::max_align_t) <= Arena::GRANULARITY);
+  }
+
+  static std::size_t RoundUp(std::size_t size) noexcept
+  {
+    return (size + Arena::GRANULARITY - 1) / Arena::GRANULARITY *
+      Arena::GRANULARITY;
+  }
+
+  void* Arena::Allocate(std::size_t size)
+  {
+    size = RoundUp(size + sizeof(Header));
+    auto arena = size <= MAX_SIZE ? current : nullptr;
+    auto hdr = static_cast<Header*>(
+      arena ? arena->Get(size) :
+      ::operator new(size, std::align_val_t{GRANULARITY}));
+    hdr->arena = arena;
+    return hdr + 1;
+  }
+
+  void Arena::Free(void* ptr, std::size_t size) noexcept
+  {
+    if (!ptr) return;
+    auto hdr = static_cast<Header*>(ptr) - 1;
+    if (hdr->arena) hdr->arena->Put(hdr, RoundUp(size + sizeof(Header)));
+    else ::operator delete(hdr, std::align_val_t{GRANULARITY});
+  }
+
+  void* Arena::Get(std::size_t size)
+  {
+    LIBSHIT_ASSERT(size % GRANULARITY == 0 && size <= MAX_SIZE);
+    auto& fl = free_lists[size / GRANULARITY - 1];
+    void* ret;
+    if (fl)
+    {
+      ret = fl;
+      fl = fl->next;
+    }
+    else
+    {
+      if (std::size_t(chunk_end - chunk_ptr) < size)
+      {
+        // the tail of the old chunk is lost, at most MAX_SIZE
+        chunks.push_back(std::unique_ptr<char, ChunkDeleter>{
+            static_cast<char*>(
+              ::operator new(CHUNK_SIZE, std::align_val_t{GRANULARITY}))});
+        chunk_ptr = chunks.back().get();
+        chunk_end = chunk_ptr + CHUNK_SIZE;
+      }
+      ret = chunk_ptr;
+      chunk_ptr += size;
+    }
+    ++refs;
+    return ret;
+  }
+
+  void Arena::Put(void* ptr, std::size_t size) noexcept
+  {
+    LIBSHIT_ASSERT(size % GRANULARITY == 0 && size <= MAX_SIZE);
+    auto& fl = free_lists[size / GRANULARITY - 1];
+    fl = new (ptr) FreeNode{fl};
+    Unref();
+  }
+
+
+  namespace
+  {
+    struct Obj
+    {
+      static void* operator new(std::size_t size)
+      { return Arena::Allocate(size); }
+      static void operator delete(void* ptr, std::size_t size) noexcept
+      { Arena::Free(ptr, size); }
+
+      virtual ~Obj() = default;
+      char data[40];
+    };
+    struct BigObj final : Obj { char more[Arena::MAX_SIZE]; };
+  }
+
+  TEST_CASE("allocation")
+  {
+    auto arena = new Arena;
+    Obj* a;
+    {
+      Arena::Scope s{arena};
+      a = new Obj;
+      auto b = new Obj;
+      CHECK(reinterpret_cast<std::uintptr_t>(a) % Arena::GRANULARITY == 0);
+      CHECK(reinterpret_cast<std::uintptr_t>(b) % Arena::GRANULARITY == 0);
+      CHECK(reinterpret_cast<char*>(b) - reinterpret_cast<char*>(a) ==
+            64);
+
+      // freed blocks are reused
+      delete b;
+      auto c = new Obj;
+      CHECK(c == b);
+      delete c;
+
+      // too big for the arena
+      Obj* big = new BigObj;
+      CHECK(reinterpret_cast<std::uintptr_t>(big) % Arena::GRANULARITY == 0);
+      delete big;
+
+      Arena::Scope s2{nullptr};
+      delete new Obj;
+    }
+    delete new Obj;
+
+    // outlives the owner
+    arena->Release();
+    for (auto& c : a->data) c = 'x';
+    delete a;
+  }
+
+  // timing against the heap, enable with --no-skip
+  TEST_CASE("arena benchmark" * doctest::skip())
+  {
+    static constexpr std::size_t N = 200000;
+    auto run = [](const char* name, Arena* arena)
+    {
+      std::vector<Obj*> objs;
+      objs.reserve(N);
+      auto start = std::chrono::steady_clock::now();
+      {
+        Arena::Scope s{arena};
+        for (std::size_t i = 0; i < N; ++i) objs.push_back(new Obj);
+      }
+      for (auto o : objs) delete o;
+      if (arena) arena->Release();
+      std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+      MESSAGE(name << ": " << time.count() * 1000 << " ms");
+    };
+    run("heap", nullptr);
+    run("arena", new Arena);
+  }
+
+  TEST_SUITE_END();
+}
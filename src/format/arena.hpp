@@ -0,0 +1,75 @@
+#ifndef UUID_2FC895CF_92E3_4EBE_B006_84ECA73EA794
+#define UUID_2FC895CF_92E3_4EBE_B006_84ECA73EA794
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace Neptools
+{
+
+  /// Slab allocator for the items and labels of a Context. Objects are
+  /// allocated from it by their operator new while an Arena::Scope is active
+  /// (Context::Create and label creation), from the heap otherwise. Freed
+  /// blocks are reused for objects of the same size class, and the chunks are
+  /// only freed together when the owner released the arena and every object
+  /// allocated from it is gone, so refcounted items can outlive their
+  /// context. Not thread safe, like Context.
+  class Arena
+  {
+  public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    void operator=(const Arena&) = delete;
+
+    /// Called by the owner instead of delete.
+    void Release() noexcept { Unref(); }
+
+    /// Makes operator new of items and labels allocate from arena (can be
+    /// nullptr) on this thread.
+    class Scope
+    {
+    public:
+      explicit Scope(Arena* arena) noexcept : old{current} { current = arena; }
+      ~Scope() { current = old; }
+      Scope(const Scope&) = delete;
+      void operator=(const Scope&) = delete;
+    private:
+      Arena* old;
+    };
+
+    static void* Allocate(std::size_t size);
+    static void Free(void* ptr, std::size_t size) noexcept;
+
+    static constexpr std::size_t GRANULARITY = 16;
+    static constexpr std::size_t MAX_SIZE = 1024;
+    static constexpr std::size_t CHUNK_SIZE = 64*1024;
+
+  private:
+    ~Arena() = default;
+    void* Get(std::size_t size);
+    void Put(void* ptr, std::size_t size) noexcept;
+    void Unref() noexcept { if (--refs == 0) delete this; }
+
+    static thread_local Arena* current;
+
+    struct FreeNode { FreeNode* next; };
+    struct ChunkDeleter
+    {
+      void operator()(char* ptr) const noexcept
+      { ::operator delete(ptr, std::align_val_t{GRANULARITY}); }
+    };
+
+    // the owner + live allocations
+    std::size_t refs = 1;
+    std::vector<std::unique_ptr<char, ChunkDeleter>> chunks;
+    char* chunk_ptr = nullptr;
+    char* chunk_end = nullptr;
+    FreeNode* free_lists[MAX_SIZE / GRANULARITY] = {};
+  };
+
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "cl3.hpp"
 #include "stcm/file.hpp"
+#include "../binary_reader.hpp"
 #include "../open.hpp"
 
 #include <libshit/char_utils.hpp>
@@ -7,11 +8,15 @@
 #include <libshit/container/ordered_map.lua.hpp>
 #include <libshit/container/vector.lua.hpp>
 
+#include <deque>
 #include <fstream>
 #include <boost/filesystem/operations.hpp>
 
+#include <libshit/doctest.hpp>
+
 namespace Neptools
 {
+  TEST_SUITE_BEGIN("Neptools::Cl3");
 
   void Cl3::Header::Validate(FilePosition file_size) const
   {
@@ -200,14 +205,16 @@ namespace Neptools
 
     field_14 = hdr.field_14;
 
-    src.Seek(hdr.sections_offset);
     uint32_t secs = hdr.sections_count;
+    std::string fallback;
+    BinaryReader sec_rd{
+      src, hdr.sections_offset, secs * sizeof(Section), fallback};
 
     uint32_t file_offset = 0, file_count = 0, file_size,
-      link_offset, link_count = 0;
+      link_offset = 0, link_count = 0;
     for (size_t i = 0; i < secs; ++i)
     {
-      auto sec = src.ReadGen<Section>();
+      auto sec = sec_rd.ReadGen<Section>();
       ToNative(sec, endian);
       sec.Validate(src.GetSize());
 
@@ -227,11 +234,16 @@ namespace Neptools
       }
     }
 
+    src.Prefetch(file_offset, file_count * sizeof(FileEntry));
+    if (link_count)
+      src.Prefetch(link_offset, link_count * sizeof(LinkEntry));
+
     entries.reserve(file_count);
-    src.Seek(file_offset);
+    BinaryReader file_rd{
+      src, file_offset, file_count * sizeof(FileEntry), fallback};
     for (uint32_t i = 0; i < file_count; ++i)
     {
-      auto e = src.ReadGen<FileEntry>();
+      auto e = file_rd.ReadGen<FileEntry>();
       ToNative(e, endian);
       e.Validate(file_size);
 
@@ -240,18 +252,25 @@ namespace Neptools
           src, file_offset+e.data_offset, e.data_size));
     }
 
-    src.Seek(file_offset);
+    // fallback is still used by file_rd
+    std::string link_fallback;
+    BinaryReader link_rd{
+      src, link_offset, link_count * sizeof(LinkEntry), link_fallback};
+    file_rd.Seek(file_offset);
     for (uint32_t i = 0; i < file_count; ++i)
     {
-      auto e = src.ReadGen<FileEntry>();
+      auto e = file_rd.ReadGen<FileEntry>();
       ToNative(e, endian);
       auto& ls = entries[i].links;
       uint32_t lbase = e.link_start;
       uint32_t lcount = e.link_count;
 
+      if (lcount)
+        link_rd.Seek<Libshit::Check::Throw>(
+          link_offset + FilePosition(lbase) * sizeof(LinkEntry));
       for (uint32_t i = lbase; i < lbase+lcount; ++i)
       {
-        auto le = src.PreadGen<LinkEntry>(link_offset + i*sizeof(LinkEntry));
+        auto le = link_rd.ReadGen<LinkEntry, Libshit::Check::Throw>();
         le.Validate(i - lbase, file_count);
         ls.emplace_back(&entries[le.linked_file_id]);
       }
@@ -285,6 +304,19 @@ namespace Neptools
     return ret;
   }
 
+  bool Cl3::CanDumpParallel() const
+  {
+    for (auto& e : entries)
+      if (e.src && !e.src->CanDumpParallel()) return false;
+    return true;
+  }
+
+  void Cl3::SetThreadSafe(bool on) const noexcept
+  {
+    for (auto& e : entries)
+      if (e.src) e.src->SetThreadSafe(on);
+  }
+
   Cl3::Entry& Cl3::GetOrCreateFile(std::string_view fname)
   {
     auto it = entries.find(fname, std::less<>{});
@@ -372,6 +404,45 @@ namespace Neptools
 #undef GEN_REVERSE
 
   void Cl3::Dump_(Sink& sink) const
+  {
+    std::vector<const Dumpable*> srcs;
+    srcs.reserve(entries.size());
+    for (auto& e : entries) srcs.push_back(e.src.get());
+    DumpWith(sink, srcs);
+  }
+
+  // Streaming needs the entry sizes before their data. Entries that are not
+  // plain sources are dumped into memory first.
+  void Cl3::DumpStream_(Sink& sink)
+  {
+    std::vector<const Dumpable*> srcs;
+    std::deque<DumpableSource> bufs; // doesn't move on insert
+    srcs.reserve(entries.size());
+    data_size = 0;
+    link_count = 0;
+    for (auto& e : entries)
+    {
+      if (e.src && !dynamic_cast<DumpableSource*>(e.src.get()))
+      {
+        MemorySink mem;
+        e.src->DumpStream(mem);
+        auto size = mem.Tell();
+        std::unique_ptr<char[]> ptr{reinterpret_cast<char*>(mem.Release().release())};
+        bufs.emplace_back(Source::FromMemory(e.name, Libshit::Move(ptr), size));
+        srcs.push_back(&bufs.back());
+      }
+      else
+        srcs.push_back(e.src.get());
+
+      if (srcs.back()) data_size += srcs.back()->GetSize();
+      data_size = (data_size + PAD) & ~PAD;
+      link_count += e.links.size();
+    }
+    DumpWith(sink, srcs);
+  }
+
+  void Cl3::DumpWith(
+    Sink& sink, const std::vector<const Dumpable*>& srcs) const
   {
     auto sections_offset = (sizeof(Header)+PAD) & ~PAD;
     auto files_offset = (sections_offset+sizeof(Section)*2+PAD) & ~PAD;
@@ -412,12 +483,13 @@ namespace Neptools
 
     // file entry header
     uint32_t offset = data_offset-files_offset, link_i = 0;
-    for (auto& e : entries)
+    for (std::size_t i = 0; i < entries.size(); ++i)
     {
+      auto& e = entries[i];
       fe.name = e.name;
       fe.field_200 = e.field_200;
       fe.data_offset = offset;
-      auto size = e.src ? e.src->GetSize() : 0;
+      auto size = srcs[i] ? srcs[i]->GetSize() : 0;
       fe.data_size = size;
       fe.link_start = link_i;
       fe.link_count = e.links.size();
@@ -428,13 +500,17 @@ namespace Neptools
     }
     sink.Pad((PAD_BYTES - ((entries.size()*sizeof(FileEntry)) & PAD)) & PAD);
 
-    // file data
-    for (auto& e : entries)
+    // file data, entries are independent of each other
+    std::vector<Part> parts;
+    parts.reserve(entries.size());
+    offset = 0;
+    for (auto s : srcs)
     {
-      if (!e.src) continue;
-      e.src->Dump(sink);
-      sink.Pad((PAD_BYTES - (e.src->GetSize() & PAD)) & PAD);
+      if (!s) continue;
+      parts.push_back({offset, s});
+      offset = (offset+s->GetSize()+PAD) & ~PAD;
     }
+    DumpParts(sink, data_size, parts);
 
     // links
     LinkEntry le;
@@ -489,6 +565,63 @@ namespace Neptools
       return nullptr;
   }};
 
+  TEST_CASE("parallel dump")
+  {
+    Cl3 cl3;
+    for (int i = 0; i < 8; ++i)
+    {
+      std::string data(300*1024 + i*7, char('a' + i));
+      cl3.entries.emplace_back(
+        "file" + std::to_string(i), 0,
+        Libshit::MakeSmart<DumpableSource>(Source::FromMemory(data)));
+    }
+    cl3.entries.emplace_back("empty");
+    cl3.Fixup();
+    REQUIRE(cl3.GetSize() > 2*MMAP_LIMIT);
+
+    auto& jobs = GetIoSettings().dump_jobs;
+    auto old_jobs = jobs;
+    jobs = 1;
+    MemorySink seq{cl3.GetSize()};
+    cl3.Dump(seq);
+
+    jobs = 4;
+    MemorySink par{cl3.GetSize()};
+    cl3.Dump(par);
+    CHECK(par.GetStringView() == seq.GetStringView());
+
+    cl3.Dump("tmp");
+    jobs = old_jobs;
+    auto file = Source::FromFile("tmp");
+    std::string act(file.GetSize(), '\0');
+    file.Pread(0, act.data(), act.size());
+    CHECK(act == seq.GetStringView());
+  }
+
+  TEST_CASE("stream dump")
+  {
+    auto inner = Libshit::MakeSmart<Cl3>();
+    inner->entries.emplace_back(
+      "inner", 0, Libshit::MakeSmart<DumpableSource>(Source::FromMemory("abc")));
+
+    Cl3 cl3{Endian::BIG};
+    cl3.entries.emplace_back(
+      "a", 1, Libshit::MakeSmart<DumpableSource>(Source::FromMemory("foo")));
+    cl3.entries.emplace_back("nested", 2, inner);
+    cl3.entries.emplace_back("empty");
+    cl3.entries[0].links.emplace_back(&cl3.entries[1]);
+
+    MemorySink stream;
+    cl3.DumpStream(stream);
+
+    cl3.Fixup();
+    REQUIRE(stream.Tell() == cl3.GetSize());
+    MemorySink exp{cl3.GetSize()};
+    cl3.Dump(exp);
+    CHECK(stream.GetStringView() == exp.GetStringView());
+  }
+
+  TEST_SUITE_END();
 }
 
 LIBSHIT_ORDERED_MAP_LUAGEN(
@@ -133,6 +133,8 @@ namespace Neptools
 
     void Fixup() override;
     FilePosition GetSize() const override;
+    LIBSHIT_NOLUA bool CanDumpParallel() const override;
+    LIBSHIT_NOLUA void SetThreadSafe(bool on) const noexcept override;
 
     Endian endian;
     uint32_t field_14;
@@ -160,6 +162,8 @@ namespace Neptools
 
     void Parse_(Source& src);
     void Dump_(Sink& os) const override;
+    void DumpStream_(Sink& sink) override;
+    void DumpWith(Sink& sink, const std::vector<const Dumpable*>& srcs) const;
     void Inspect_(std::ostream& os, unsigned indent) const override;
   };
 
@@ -1,42 +1,52 @@
 #include "context.hpp"
 #include "item.hpp"
+#include "raw_item.hpp"
 #include "../utils.hpp"
 
 #include <libshit/except.hpp>
 #include <libshit/char_utils.hpp>
-#include <iomanip>
+#include <charconv>
+#include <chrono>
 #include <fstream>
-#include <sstream>
+#include <iterator>
+
+#include <libshit/doctest.hpp>
 
 namespace Neptools
 {
+  TEST_SUITE_BEGIN("Neptools::Context");
 
   Context::Context()
-    : ItemWithChildren{Key{}, *this}
+    : ItemWithChildren{Key{}, *this},
+      label_buckets{new LabelsMap::bucket_type[INITIAL_LABEL_BUCKETS]},
+      labels{LabelsMap::bucket_traits{
+          label_buckets.get(), INITIAL_LABEL_BUCKETS}}
   {}
 
   Context::~Context()
   {
     Context::Dispose();
+    arena->Release();
   }
 
   void Context::SetupParseFrom(Item& item)
   {
-    pmap[0] = &item;
+    pmap.Insert(0, &item);
     GetChildren().push_back(item); // noexcept
   }
 
   void Context::Fixup()
   {
-    pmap.clear();
+    MarkAllDirty();
+    FixupDirty();
+  }
 
-    FilePosition pos = 0;
-    for (auto& c : GetChildren())
-    {
-      c.UpdatePosition(pos);
-      pos += c.GetSize();
-    }
-    // todo? size = pos;
+  void Context::FixupDirty()
+  {
+    if (!IsDirty()) return;
+    pmap.Clear();
+    Fixup_(0);
+    dirty = false;
   }
 
 
@@ -49,10 +59,28 @@ namespace Neptools
     return MakeNotNull(const_cast<Label*>(&*it));
   }
 
+  Label* Context::NewLabel(std::string name, ItemPointer ptr)
+  {
+    Arena::Scope scope{arena};
+    return new Label{std::move(name), ptr};
+  }
+
+  void Context::ReserveLabel()
+  {
+    auto n = labels.bucket_count();
+    if (labels.size() < n) return;
+
+    std::unique_ptr<LabelsMap::bucket_type[]> nbuckets{
+      new LabelsMap::bucket_type[2*n]};
+    labels.rehash(LabelsMap::bucket_traits{nbuckets.get(), 2*n});
+    label_buckets = std::move(nbuckets);
+  }
+
   Libshit::NotNull<LabelPtr> Context::CreateLabel(
     std::string name, ItemPointer ptr)
   {
-    auto lbl = new Label{std::move(name), ptr};
+    ReserveLabel();
+    auto lbl = NewLabel(std::move(name), ptr);
     auto pair = labels.insert(*lbl);
     if (!pair.second)
     {
@@ -66,22 +94,39 @@ namespace Neptools
     return MakeNotNull(&*pair.first);
   }
 
+  // append n to str in base, at least width digits
+  static void AppendNum(
+    std::string& str, std::uint64_t n, int base = 10, std::size_t width = 0)
+  {
+    char buf[64];
+    auto end = std::to_chars(std::begin(buf), std::end(buf), n, base).ptr;
+    if (std::size_t(end - buf) < width) str.append(width - (end - buf), '0');
+    str.append(buf, end);
+  }
+
   Libshit::NotNull<LabelPtr> Context::CreateLabelFallback(
     const std::string& name, ItemPointer ptr)
   {
+    ReserveLabel();
     LabelsMap::insert_commit_data commit;
     std::string str = name;
 
     auto pair = labels.insert_check(str, commit);
-    for (int i = 1; !pair.second; ++i)
+    if (!pair.second)
     {
-      std::stringstream ss;
-      ss << name << '_' << i;
-      str = ss.str();
-      pair = labels.insert_check(str, commit);
+      // labels are only removed on Dispose, so every suffix up to the last
+      // one used for name is still taken
+      auto& i = label_suffixes[name];
+      do
+      {
+        str.resize(name.size());
+        str += '_';
+        AppendNum(str, ++i);
+        pair = labels.insert_check(str, commit);
+      } while (!pair.second);
     }
 
-    auto it = labels.insert_commit(*new Label{std::move(str), ptr}, commit);
+    auto it = labels.insert_commit(*NewLabel(std::move(str), ptr), commit);
 
     ptr->labels.insert(*it);
     return MakeNotNull(&*it);
@@ -90,12 +135,13 @@ namespace Neptools
   Libshit::NotNull<LabelPtr> Context::CreateOrSetLabel(
     std::string name, ItemPointer ptr)
   {
+    ReserveLabel();
     LabelsMap::insert_commit_data commit;
     auto [it, insertable] = labels.insert_check(name, commit);
 
     if (insertable)
     {
-      auto it = labels.insert_commit(*new Label{std::move(name), ptr}, commit);
+      auto it = labels.insert_commit(*NewLabel(std::move(name), ptr), commit);
       ptr->labels.insert(*it);
       return MakeNotNull(&*it);
     }
@@ -110,12 +156,13 @@ namespace Neptools
 
   Libshit::NotNull<LabelPtr> Context::GetOrCreateDummyLabel(std::string name)
   {
+    ReserveLabel();
     LabelsMap::insert_commit_data commit;
     auto [it, insertable] = labels.insert_check(name, commit);
 
     if (insertable)
       it = labels.insert_commit(
-        *new Label{std::move(name), {nullptr,0}}, commit);
+        *NewLabel(std::move(name), {nullptr,0}), commit);
     return MakeNotNull(const_cast<Label*>(&*it));
   }
 
@@ -125,10 +172,9 @@ namespace Neptools
     auto it = lctr.find(ptr.offset);
     if (it != lctr.end()) return MakeNotNull(&*it);
 
-    std::stringstream ss;
-    ss << "loc_" << std::setw(8) << std::setfill('0') << std::hex
-       << ptr.item->GetPosition() + ptr.offset;
-    return CreateLabelFallback(ss.str(), ptr);
+    std::string name = "loc_";
+    AppendNum(name, ptr.item->GetPosition() + ptr.offset, 16, 8);
+    return CreateLabelFallback(name, ptr);
   }
 
   Libshit::NotNull<LabelPtr> Context::GetLabelTo(
@@ -144,16 +190,15 @@ namespace Neptools
 
   ItemPointer Context::GetPointer(FilePosition pos) const noexcept
   {
-    auto it = pmap.upper_bound(pos);
-    LIBSHIT_ASSERT_MSG(it != pmap.begin(), "file position out of range");
-    --it;
-    LIBSHIT_ASSERT(it->first == it->second->GetPosition());
-    return {it->second, pos - it->first};
+    auto [ipos, item] = pmap.Floor(pos);
+    LIBSHIT_ASSERT_MSG(item, "file position out of range");
+    LIBSHIT_ASSERT(ipos == item->GetPosition());
+    return {item, pos - ipos};
   }
 
   void Context::Dispose() noexcept
   {
-    pmap.clear();
+    pmap.Clear();
     struct Disposer
     {
       void operator()(Label* l)
@@ -168,6 +213,7 @@ namespace Neptools
       }
     };
     labels.clear_and_dispose(Disposer{});
+    label_suffixes.clear();
     GetChildren().clear();
 
     ItemWithChildren::Dispose();
@@ -180,6 +226,73 @@ namespace Neptools
     return os << "l(" << Libshit::Quoted(l.label->GetName()) << ')';
   }
 
+  namespace
+  {
+    struct TestContext final : Context
+    {
+      void Inspect_(std::ostream&, unsigned) const override {}
+    };
+  }
+
+  TEST_CASE("labels")
+  {
+    // enough to rehash a few times
+    static constexpr int N = 10000;
+    auto ctx = Libshit::MakeSmart<TestContext>();
+    auto item = ctx->Create<RawItem>(std::string(N, 'x'));
+    ctx->GetChildren().push_back(*item);
+
+    for (int i = 0; i < N; ++i)
+      ctx->CreateLabel("label_" + std::to_string(i), {&*item, FilePosition(i)});
+    // what the lua builder does for every reference
+    for (int i = 0; i < N; ++i)
+      REQUIRE(ctx->GetOrCreateDummyLabel("label_" + std::to_string(i))
+              ->GetPtr().offset == FilePosition(i));
+
+    CHECK(ctx->GetLabel("label_123")->GetPtr().offset == 123);
+    CHECK_THROWS(ctx->GetLabel("label_-1"));
+    CHECK_THROWS(ctx->CreateLabel("label_7", {&*item, 0}));
+
+    CHECK(ctx->CreateLabelFallback("label_7", {&*item, 1})->GetName() ==
+          "label_7_1");
+    ctx->CreateLabel("label_7_3", {&*item, 0});
+    CHECK(ctx->CreateLabelFallback("label_7", {&*item, 2})->GetName() ==
+          "label_7_2");
+    CHECK(ctx->CreateLabelFallback("label_7", {&*item, 2})->GetName() ==
+          "label_7_4");
+    CHECK(ctx->GetLabelTo({&*item, 0x1234})->GetName() == "label_4660");
+    auto item2 = ctx->Create<RawItem>("abcd");
+    ctx->GetChildren().push_back(*item2);
+    ctx->Fixup();
+    CHECK(ctx->GetLabelTo({&*item2, 2})->GetName() == "loc_00002712");
+    auto dummy = ctx->GetOrCreateDummyLabel("dummy");
+    CHECK(dummy->GetPtr().item == nullptr);
+    CHECK(ctx->CreateOrSetLabel("dummy", {&*item, 3}).get() == dummy.get());
+    CHECK(dummy->GetPtr().offset == 3);
+  }
+
+  // measures label creation and lookup, only with --no-skip
+  TEST_CASE("label benchmark" * doctest::skip())
+  {
+    static constexpr int N = 100000;
+    auto ctx = Libshit::MakeSmart<TestContext>();
+    auto item = ctx->Create<RawItem>(std::string(N, 'x'));
+    ctx->GetChildren().push_back(*item);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N; ++i)
+      ctx->CreateLabel("label_" + std::to_string(i), {&*item, FilePosition(i)});
+    std::size_t found = 0;
+    for (int i = 0; i < N; ++i)
+      found += ctx->GetOrCreateDummyLabel("label_" + std::to_string(i))
+        ->GetPtr().offset == FilePosition(i);
+    std::chrono::duration<double> time =
+      std::chrono::steady_clock::now() - start;
+    MESSAGE("create + lookup: " << time.count() * 1000 << " ms");
+    CHECK(found == N);
+  }
+
+  TEST_SUITE_END();
 }
 
 #include "context.binding.hpp"
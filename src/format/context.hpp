@@ -3,11 +3,14 @@
 #pragma once
 
 #include "item.hpp"
+#include "pointer_map.hpp"
 #include "../dumpable.hpp"
 
-#include <boost/intrusive/set.hpp>
+#include <boost/intrusive/unordered_set.hpp>
+#include <functional>
+#include <memory>
 #include <string>
-#include <map>
+#include <unordered_map>
 
 namespace Neptools
 {
@@ -19,11 +22,19 @@ namespace Neptools
     Context();
     ~Context() override;
 
+    /// Relayouts every item, changes made without MarkDirty (like assigning
+    /// fields from lua) are picked up too.
     void Fixup() override;
+    /// Incremental Fixup, only relayouts dirty items (see Item::MarkDirty).
+    /// Only use it when every change since the last Fixup was marked, like
+    /// after a ReadTxt on a parsed file.
+    LIBSHIT_NOLUA void FixupDirty();
 
+    /// Items (and labels) are allocated from the context's arena, see Arena.
     template <typename T, typename... Args>
     LIBSHIT_NOLUA Libshit::NotNull<Libshit::SmartPtr<T>> Create(Args&&... args)
     {
+      Arena::Scope scope{arena};
       return Libshit::MakeSmart<T>(
         Item::Key{}, *this, std::forward<Args>(args)...);
     }
@@ -52,20 +63,35 @@ namespace Neptools
 
   protected:
     void SetupParseFrom(Item& item);
+    /// Call when parsing is finished: items are at their parsed positions, so
+    /// they don't need a Fixup until they change.
+    void ParseDone() noexcept { MarkClean(); }
 
   private:
     friend class Item;
 
-    // properties needed: stable pointers
-    using LabelsMap = boost::intrusive::set<
+    // released in the destructor, items keep it alive if they outlive us
+    Arena* arena = new Arena;
+    Label* NewLabel(std::string name, ItemPointer ptr);
+
+    // properties needed: stable pointers. Hashes are stored in the labels, so
+    // lookups only compare names on hash matches.
+    using LabelsMap = boost::intrusive::unordered_set<
       Label,
       boost::intrusive::base_hook<LabelNameHook>,
-      boost::intrusive::constant_time_size<false>,
+      boost::intrusive::constant_time_size<true>,
+      boost::intrusive::power_2_buckets<true>,
+      boost::intrusive::hash<std::hash<std::string>>,
       boost::intrusive::key_of_value<LabelKeyOfValue>>;
+    static constexpr std::size_t INITIAL_LABEL_BUCKETS = 64;
+    std::unique_ptr<LabelsMap::bucket_type[]> label_buckets;
     LabelsMap labels;
+    /// Grow the buckets if a new label would exceed a load factor of 1.
+    /// Invalidates insert_commit_datas.
+    void ReserveLabel();
+    // last suffix used by CreateLabelFallback for a name
+    std::unordered_map<std::string, std::size_t> label_suffixes;
 
-    // properties needed: sorted
-    using PointerMap = std::map<FilePosition, Item*>;
     PointerMap pmap;
   };
 
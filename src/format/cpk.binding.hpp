@@ -0,0 +1,31 @@
+// Auto generated code, do not edit. See gen_binding in project root.
+#if LIBSHIT_WITH_LUA
+#include <libshit/lua/user_type.hpp>
+
+
+const char ::Neptools::Cpk::TYPE_NAME[] = "neptools.cpk";
+
+namespace Libshit::Lua
+{
+
+  // class neptools.cpk
+  template<>
+  void TypeRegisterTraits<::Neptools::Cpk>::Register(TypeBuilder& bld)
+  {
+    bld.Inherit<::Neptools::Cpk, ::Neptools::Dumpable>();
+
+    bld.AddFunction<
+      &::Libshit::Lua::TypeTraits<::Neptools::Cpk>::Make<LuaGetRef<::Neptools::Source>>
+    >("new");
+    bld.AddFunction<
+      static_cast<::Neptools::Source (::Neptools::Cpk::*)(std::string_view) const>(&::Neptools::Cpk::GetSource)
+    >("get_source");
+    bld.AddFunction<
+      static_cast<void (::Neptools::Cpk::*)(const ::boost::filesystem::path &) const>(&::Neptools::Cpk::ExtractTo)
+    >("extract_to");
+
+  }
+  static TypeRegister::StateRegister<::Neptools::Cpk> reg_neptools_cpk;
+
+}
+#endif
@@ -0,0 +1,790 @@
+#include "cpk.hpp"
+#include "../open.hpp"
+#include "../sink.hpp"
+
+#include <libshit/assert.hpp>
+#include <libshit/char_utils.hpp>
+#include <libshit/except.hpp>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#include <libshit/doctest.hpp>
+
+namespace Neptools
+{
+  TEST_SUITE_BEGIN("Neptools::Cpk");
+
+  namespace
+  {
+
+    // @UTF table, the generic container of every cpk table. Everything is big
+    // endian, offsets are relative to the start of the table + 8.
+    class UtfTable
+    {
+    public:
+      UtfTable(std::string data);
+
+      std::uint32_t GetRowCount() const noexcept { return rows; }
+      bool HasColumn(std::string_view name) const noexcept
+      { return FindColumn(name); }
+
+      std::uint64_t GetInt(std::uint32_t row, std::string_view name) const;
+      std::string GetString(std::uint32_t row, std::string_view name) const;
+
+    private:
+      enum Storage : std::uint8_t
+      {
+        STORAGE_MASK = 0xf0, STORAGE_ZERO = 0x10, STORAGE_CONSTANT = 0x30,
+        STORAGE_ROW = 0x50, STORAGE_CONSTANT2 = 0x70,
+      };
+      enum Type : std::uint8_t
+      {
+        TYPE_MASK = 0x0f, TYPE_U8 = 0, TYPE_S8, TYPE_U16, TYPE_S16, TYPE_U32,
+        TYPE_S32, TYPE_U64, TYPE_S64, TYPE_FLOAT, TYPE_DOUBLE, TYPE_STRING,
+        TYPE_DATA,
+      };
+
+      struct Column
+      {
+        std::uint8_t flags;
+        std::string name;
+        std::size_t offset; // constant: in data, row: inside the row
+      };
+
+      const Column* FindColumn(std::string_view name) const noexcept;
+      const Column& GetColumn(std::string_view name) const;
+      std::size_t GetValueOffset(std::uint32_t row, const Column& col) const;
+
+      void Check(std::size_t offs, std::size_t size) const;
+      template <typename T> T Get(std::size_t offs) const
+      {
+        Check(offs, sizeof(T));
+        T ret;
+        memcpy(&ret, data.data() + offs, sizeof(T));
+        return boost::endian::big_to_native(ret);
+      }
+      std::string GetCString(std::size_t offs) const;
+
+      static std::size_t GetTypeSize(std::uint8_t type);
+
+      std::string data;
+      std::size_t rows_offset, strings_offset, row_width;
+      std::uint32_t rows;
+      std::vector<Column> columns;
+    };
+
+    // utf tables in the header of some cpks are obfuscated
+    void DecryptUtf(std::string& data) noexcept
+    {
+      std::uint32_t m = 0x655f;
+      for (auto& c : data)
+      {
+        c ^= static_cast<char>(m & 0xff);
+        m *= 0x4115;
+      }
+    }
+
+    UtfTable::UtfTable(std::string data_in) : data{Libshit::Move(data_in)}
+    {
+#define VALIDATE(x) LIBSHIT_VALIDATE_FIELD("Cpk::UtfTable", x)
+      if (data.size() >= 4 && memcmp(data.data(), "@UTF", 4) != 0)
+        DecryptUtf(data);
+      VALIDATE(data.size() >= 0x20 && memcmp(data.data(), "@UTF", 4) == 0);
+
+      auto table_size = Get<std::uint32_t>(0x04);
+      VALIDATE(table_size <= data.size() - 8);
+      rows_offset = Get<std::uint16_t>(0x0a) + 8;
+      strings_offset = Get<std::uint32_t>(0x0c) + 8;
+      auto column_count = Get<std::uint16_t>(0x18);
+      row_width = Get<std::uint16_t>(0x1a);
+      rows = Get<std::uint32_t>(0x1c);
+      VALIDATE(strings_offset <= data.size());
+      VALIDATE(rows_offset + FilePosition(row_width) * rows <= data.size());
+
+      columns.reserve(column_count);
+      std::size_t pos = 0x20, row_pos = 0;
+      for (std::size_t i = 0; i < column_count; ++i)
+      {
+        Column col;
+        col.flags = Get<std::uint8_t>(pos++);
+        if (col.flags & STORAGE_ZERO)
+        {
+          col.name = GetCString(strings_offset + Get<std::uint32_t>(pos));
+          pos += 4;
+        }
+
+        auto size = GetTypeSize(col.flags & TYPE_MASK);
+        switch (col.flags & STORAGE_MASK)
+        {
+        case STORAGE_ZERO:
+          col.offset = 0;
+          break;
+        case STORAGE_CONSTANT:
+        case STORAGE_CONSTANT2:
+          col.offset = pos;
+          pos += size;
+          break;
+        case STORAGE_ROW:
+          col.offset = row_pos;
+          row_pos += size;
+          break;
+        default:
+          LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: invalid storage",
+                        "Column flags", unsigned(col.flags));
+        }
+        columns.push_back(Libshit::Move(col));
+      }
+      VALIDATE(row_pos <= row_width);
+#undef VALIDATE
+    }
+
+    std::size_t UtfTable::GetTypeSize(std::uint8_t type)
+    {
+      switch (type)
+      {
+      case TYPE_U8:  case TYPE_S8:  return 1;
+      case TYPE_U16: case TYPE_S16: return 2;
+      case TYPE_U32: case TYPE_S32: case TYPE_FLOAT: case TYPE_STRING: return 4;
+      case TYPE_U64: case TYPE_S64: case TYPE_DOUBLE: case TYPE_DATA: return 8;
+      }
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: invalid column type",
+                    "Column type", unsigned(type));
+    }
+
+    void UtfTable::Check(std::size_t offs, std::size_t size) const
+    {
+      if (offs > data.size() || data.size() - offs < size)
+        LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: premature end");
+    }
+
+    std::string UtfTable::GetCString(std::size_t offs) const
+    {
+      Check(offs, 0);
+      auto len = strnlen(data.data() + offs, data.size() - offs);
+      if (offs + len == data.size())
+        LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: unterminated string");
+      return {data.data() + offs, len};
+    }
+
+    auto UtfTable::FindColumn(std::string_view name) const noexcept
+      -> const Column*
+    {
+      for (const auto& c : columns)
+        if (c.name == name) return &c;
+      return nullptr;
+    }
+
+    auto UtfTable::GetColumn(std::string_view name) const -> const Column&
+    {
+      if (auto c = FindColumn(name)) return *c;
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: missing column",
+                    "Column", std::string{name});
+    }
+
+    std::size_t UtfTable::GetValueOffset(
+      std::uint32_t row, const Column& col) const
+    {
+      LIBSHIT_ASSERT(row < rows);
+      if ((col.flags & STORAGE_MASK) == STORAGE_ROW)
+        return rows_offset + row * row_width + col.offset;
+      return col.offset;
+    }
+
+    std::uint64_t UtfTable::GetInt(std::uint32_t row, std::string_view name) const
+    {
+      auto& col = GetColumn(name);
+      if ((col.flags & STORAGE_MASK) == STORAGE_ZERO) return 0;
+      auto offs = GetValueOffset(row, col);
+      switch (col.flags & TYPE_MASK)
+      {
+      case TYPE_U8:  case TYPE_S8:  return Get<std::uint8_t>(offs);
+      case TYPE_U16: case TYPE_S16: return Get<std::uint16_t>(offs);
+      case TYPE_U32: case TYPE_S32: return Get<std::uint32_t>(offs);
+      case TYPE_U64: case TYPE_S64: return Get<std::uint64_t>(offs);
+      }
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: not an integer column",
+                    "Column", std::string{name});
+    }
+
+    std::string UtfTable::GetString(
+      std::uint32_t row, std::string_view name) const
+    {
+      auto& col = GetColumn(name);
+      if ((col.flags & STORAGE_MASK) == STORAGE_ZERO) return {};
+      if ((col.flags & TYPE_MASK) != TYPE_STRING)
+        LIBSHIT_THROW(Libshit::DecodeError, "Cpk::UtfTable: not a string column",
+                      "Column", std::string{name});
+      return GetCString(
+        strings_offset + Get<std::uint32_t>(GetValueOffset(row, col)));
+    }
+
+
+    // CRILAYLA: a backward LZ stream. Bits are read from the end of the
+    // compressed data towards its beginning, output is produced from the end
+    // too, so there are no seek points: an entry is decompressed as a whole.
+    struct CrilaylaHeader
+    {
+      char magic[8];
+      boost::endian::little_uint32_t uncompressed_size;
+      boost::endian::little_uint32_t header_offset;
+    };
+    static_assert(sizeof(CrilaylaHeader) == 0x10);
+    static constexpr std::size_t CRILAYLA_RAW_SIZE = 0x100;
+
+    class CrilaylaBits
+    {
+    public:
+      CrilaylaBits(const Byte* begin, const Byte* end) noexcept
+        : begin{begin}, ptr{end} {}
+
+      unsigned Get(unsigned count)
+      {
+        unsigned ret = 0;
+        while (count)
+        {
+          if (bits_left == 0)
+          {
+            if (ptr == begin)
+              LIBSHIT_THROW(Libshit::DecodeError,
+                            "Crilayla: premature end of compressed data");
+            pool = *--ptr;
+            bits_left = 8;
+          }
+          auto n = std::min(count, bits_left);
+          ret = (ret << n) | ((pool >> (bits_left - n)) & ((1u << n) - 1));
+          bits_left -= n;
+          count -= n;
+        }
+        return ret;
+      }
+
+    private:
+      const Byte* begin;
+      const Byte* ptr;
+      Byte pool = 0;
+      unsigned bits_left = 0;
+    };
+
+    void Crilayla(const Byte* in, std::size_t in_size, Byte* out,
+                  std::size_t out_size)
+    {
+#define VALIDATE(x) LIBSHIT_VALIDATE_FIELD("Crilayla", x)
+      VALIDATE(in_size >= sizeof(CrilaylaHeader) + CRILAYLA_RAW_SIZE);
+      CrilaylaHeader hdr;
+      memcpy(&hdr, in, sizeof(hdr));
+      VALIDATE(memcmp(hdr.magic, "CRILAYLA", 8) == 0);
+      VALIDATE(hdr.uncompressed_size + CRILAYLA_RAW_SIZE == out_size);
+      VALIDATE(sizeof(CrilaylaHeader) + hdr.header_offset + CRILAYLA_RAW_SIZE
+               <= in_size);
+#undef VALIDATE
+
+      auto comp_begin = in + sizeof(CrilaylaHeader);
+      auto comp_end = comp_begin + hdr.header_offset;
+      memcpy(out, comp_end, CRILAYLA_RAW_SIZE);
+
+      static constexpr unsigned VLE_LENS[] = { 2, 3, 5, 8 };
+      CrilaylaBits bits{comp_begin, comp_end};
+      std::size_t rem = hdr.uncompressed_size;
+      // output position: out[rem + CRILAYLA_RAW_SIZE - 1] is the next to write
+      auto dst = out + CRILAYLA_RAW_SIZE + rem;
+      auto out_end = dst;
+      while (rem)
+      {
+        if (bits.Get(1))
+        {
+          std::size_t ref_offs = bits.Get(13) + 3;
+          std::size_t len = 3;
+          bool more = true;
+          for (auto bl : VLE_LENS)
+          {
+            unsigned x = bits.Get(bl);
+            len += x;
+            if (x != (1u << bl) - 1) { more = false; break; }
+          }
+          if (more)
+          {
+            unsigned x;
+            do
+            {
+              x = bits.Get(8);
+              len += x;
+            } while (x == 255);
+          }
+
+          // dst[-1] is the next byte to write, the reference starts
+          // ref_offs bytes after it and must be already written
+          if (ref_offs > std::size_t(out_end - dst) || len > rem)
+            LIBSHIT_THROW(Libshit::DecodeError, "Crilayla: invalid reference",
+                          "Offset", ref_offs, "Length", len);
+          auto ref = dst - 1 + ref_offs;
+          for (std::size_t i = 0; i < len; ++i)
+            *--dst = *ref--;
+          rem -= len;
+        }
+        else
+        {
+          *--dst = bits.Get(8);
+          --rem;
+        }
+      }
+    }
+
+    struct CrilaylaProvider final : public Source::Provider
+    {
+      CrilaylaProvider(Source src, boost::filesystem::path file_name,
+                       FilePosition size)
+        : Source::Provider{Libshit::Move(file_name), size},
+          src{Libshit::Move(src)} {}
+
+      void Pread(FilePosition offs, Byte* buf, FileMemSize len) override;
+      bool HasStableChunks() const noexcept override { return true; }
+      // kept after decompression, so this is always the same source
+      void SetSourcesThreadSafe(bool on) noexcept override
+      { src.SetThreadSafe(on); }
+
+      Source src;
+      std::once_flag decompressed;
+      std::unique_ptr<Byte[]> data;
+    };
+
+    void CrilaylaProvider::Pread(FilePosition offs, Byte* buf, FileMemSize len)
+    {
+      std::call_once(decompressed, [&]()
+      {
+        std::string fallback;
+        auto in = src.GetContiguous(0, src.GetSize(), fallback);
+        std::unique_ptr<Byte[]> out{new Byte[size]};
+        ADD_SOURCE(Crilayla(reinterpret_cast<const Byte*>(in.data()),
+                            in.size(), out.get(), size), src);
+        data = Libshit::Move(out);
+      });
+
+      // the whole entry is one chunk, it never leaves the LRU (of this thread)
+      // once added
+      if (!LruGet(offs)) LruPush(data.get(), 0, size);
+      if (len)
+      {
+        memcpy(buf, data.get() + offs, len);
+        Count(IoStats::BYTES_COPIED, len);
+      }
+    }
+
+  }
+
+  Source DecompressCrilayla(const Source& src, boost::filesystem::path fname)
+  {
+    src.CheckSize(sizeof(CrilaylaHeader));
+    auto hdr = src.PreadGen<CrilaylaHeader>(0);
+    if (memcmp(hdr.magic, "CRILAYLA", 8) != 0)
+      LIBSHIT_THROW(Libshit::DecodeError, "Crilayla: invalid magic",
+                    "Used source", src);
+    return {Libshit::MakeSmart<CrilaylaProvider>(
+        src, Libshit::Move(fname), hdr.uncompressed_size + CRILAYLA_RAW_SIZE)};
+  }
+
+
+  Cpk::Cpk(Source src) : src{Libshit::Move(src)}
+  {
+    ADD_SOURCE(Parse_(), this->src);
+  }
+
+  static UtfTable ReadUtf(const Source& src, FilePosition offs, const char* magic)
+  {
+    if (offs > src.GetSize() || src.GetSize() - offs < 0x10)
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk: table out of range",
+                    "Offset", offs);
+    char hdr[4];
+    src.Pread(offs, hdr, 4);
+    if (memcmp(hdr, magic, 4) != 0)
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk: invalid table header",
+                    "Expected", magic);
+    auto size = src.PreadLittleUint64(offs + 8);
+    // offs + 0x10 + size could overflow
+    if (size > src.GetSize() - offs - 0x10)
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk: table out of range",
+                    "Offset", offs, "Size", size);
+
+    std::string data(size, '\0');
+    src.Pread(offs + 0x10, data.data(), size);
+    return {Libshit::Move(data)};
+  }
+
+  // entry names end up in paths in ExtractTo, they must stay inside the
+  // target directory
+  static bool IsSafeEntryName(std::string_view name) noexcept
+  {
+    if (name.empty() || name[0] == '/' || name[0] == '\\' ||
+        name.find(':') != std::string_view::npos)
+      return false;
+    while (!name.empty())
+    {
+      auto i = name.find_first_of("/\\");
+      if (name.substr(0, i) == "..") return false;
+      if (i == std::string_view::npos) break;
+      name.remove_prefix(i + 1);
+    }
+    return true;
+  }
+
+  void Cpk::Parse_()
+  {
+    auto hdr = ReadUtf(src, 0, "CPK ");
+    if (hdr.GetRowCount() != 1)
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk: invalid header table");
+    if (!hdr.HasColumn("TocOffset") || hdr.GetInt(0, "TocOffset") == 0)
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk: archives without TOC "
+                    "(ID only) are not supported");
+
+    auto toc_offset = hdr.GetInt(0, "TocOffset");
+    // file offsets are relative to the start of the content or the toc,
+    // whichever comes first
+    auto base = toc_offset;
+    if (hdr.HasColumn("ContentOffset"))
+    {
+      auto content_offset = hdr.GetInt(0, "ContentOffset");
+      if (content_offset && content_offset < base) base = content_offset;
+    }
+
+    auto toc = ReadUtf(src, toc_offset, "TOC ");
+    auto count = toc.GetRowCount();
+    entries.reserve(count);
+    for (std::uint32_t i = 0; i < count; ++i)
+    {
+      auto dir = toc.GetString(i, "DirName");
+      auto file = toc.GetString(i, "FileName");
+      Entry e{dir.empty() ? Libshit::Move(file) : dir + '/' + file,
+              base + toc.GetInt(i, "FileOffset"),
+              toc.GetInt(i, "FileSize"), toc.GetInt(i, "ExtractSize")};
+      if (!IsSafeEntryName(e.name))
+        LIBSHIT_THROW(Libshit::DecodeError, "Cpk: invalid entry name",
+                      "Entry name", e.name);
+      if (e.offset > src.GetSize() || src.GetSize() - e.offset < e.size)
+        LIBSHIT_THROW(Libshit::DecodeError, "Cpk: entry out of range",
+                      "Entry name", e.name);
+      entries.push_back(Libshit::Move(e));
+    }
+
+    // entries won't move anymore
+    entry_map.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+      entry_map.emplace(entries[i].name, i);
+  }
+
+  auto Cpk::FindEntry(std::string_view name) const noexcept -> const Entry*
+  {
+    auto it = entry_map.find(name);
+    return it == entry_map.end() ? nullptr : &entries[it->second];
+  }
+
+  Source Cpk::GetSource(std::string_view name) const
+  {
+    auto e = FindEntry(name);
+    if (!e)
+      LIBSHIT_THROW(std::out_of_range, "Cpk::GetSource: no such entry",
+                    "Entry name", std::string{name});
+    return GetSource(*e);
+  }
+
+  Source Cpk::GetSource(const Entry& e) const
+  {
+    if (!e.IsCompressed()) return {src, e.offset, e.size};
+
+    for (auto it = cache.begin(); it != cache.end(); ++it)
+      if (it->first == &e)
+      {
+        std::rotate(cache.begin(), it, it + 1);
+        return cache.front().second;
+      }
+
+    auto ret = DecompressCrilayla({src, e.offset, e.size}, e.name);
+    if (ret.GetSize() != e.extract_size)
+      LIBSHIT_THROW(Libshit::DecodeError, "Cpk: invalid extracted size",
+                    "Entry name", e.name);
+
+    if (cache.size() == CACHE_SIZE) cache.pop_back();
+    cache.emplace(cache.begin(), &e, ret);
+    return ret;
+  }
+
+  void Cpk::ExtractTo(const boost::filesystem::path& dir) const
+  {
+    for (const auto& e : entries)
+    {
+      auto pth = dir / e.name;
+      boost::filesystem::create_directories(pth.parent_path());
+      // don't pollute the cache with every entry
+      auto s = e.IsCompressed() ?
+        DecompressCrilayla({src, e.offset, e.size}, e.name) :
+        Source{src, e.offset, e.size};
+      s.Dump(*Sink::ToFile(pth, s.GetSize()));
+    }
+  }
+
+  void Cpk::Inspect_(std::ostream& os, unsigned) const
+  {
+    os << "neptools.cpk(";
+    src.Inspect(os);
+    os << ')';
+  }
+
+  static OpenFactory cpk_open{[](const Source& src) -> Libshit::SmartPtr<Dumpable>
+  {
+    if (src.GetSize() < 0x10) return nullptr;
+    char buf[4];
+    src.PreadGen(0, buf);
+    if (memcmp(buf, "CPK ", 4) == 0)
+      return Libshit::MakeSmart<Cpk>(src);
+    else
+      return nullptr;
+  }};
+
+
+  // compress data using only literals and one back reference before the end
+  static std::string CrilaylaTestData(std::string_view payload)
+  {
+    std::vector<bool> bits;
+    auto add = [&](unsigned val, unsigned n)
+    { while (n--) bits.push_back((val >> n) & 1); };
+
+    // output is produced backwards: last 3 bytes as literals, then the rest
+    // must be a repetition of them
+    REQUIRE(payload.size() == 6);
+    for (int i = 5; i >= 3; --i) { add(0, 1); add(Byte(payload[i]), 8); }
+    add(1, 1); add(0, 13); add(0, 2);
+
+    std::string comp((bits.size() + 7) / 8, '\0');
+    for (std::size_t i = 0; i < bits.size(); ++i)
+      if (bits[i]) comp[i/8] |= 0x80 >> (i%8);
+    std::reverse(comp.begin(), comp.end());
+
+    CrilaylaHeader hdr;
+    memcpy(hdr.magic, "CRILAYLA", 8);
+    hdr.uncompressed_size = payload.size();
+    hdr.header_offset = comp.size();
+    std::string ret{reinterpret_cast<char*>(&hdr), sizeof(hdr)};
+    ret += comp;
+    for (std::size_t i = 0; i < CRILAYLA_RAW_SIZE; ++i) ret += char(i);
+    return ret;
+  }
+
+  TEST_CASE("crilayla")
+  {
+    auto src = DecompressCrilayla(Source::FromMemory(CrilaylaTestData("xyzxyz")));
+    REQUIRE(src.GetSize() == CRILAYLA_RAW_SIZE + 6);
+
+    std::string exp;
+    for (std::size_t i = 0; i < CRILAYLA_RAW_SIZE; ++i) exp += char(i);
+    exp += "xyzxyz";
+    std::string act(exp.size(), '\0');
+    src.Pread(0, act.data(), act.size());
+    CHECK(act == exp);
+  }
+
+  namespace
+  {
+    // a column of a test @UTF table, stored per row
+    struct TestColumn
+    {
+      const char* name;
+      std::vector<std::uint64_t> ints; // TYPE_U64 if not empty
+      std::vector<std::string> strs; // TYPE_STRING otherwise
+    };
+  }
+
+  static void PutBig(std::string& out, std::uint64_t val, unsigned n)
+  {
+    while (n--) out += char(val >> (n*8));
+  }
+
+  static std::string UtfTestData(
+    const std::vector<TestColumn>& cols, std::uint32_t rows)
+  {
+    std::string strings{"test"};
+    strings += '\0';
+    auto add_string = [&](const std::string& str)
+    {
+      auto ret = strings.size();
+      strings += str;
+      strings += '\0';
+      return ret;
+    };
+
+    std::string col_data, row_data;
+    std::size_t row_width = 0;
+    for (const auto& c : cols)
+    {
+      bool is_int = !c.ints.empty();
+      col_data += char(0x50 | (is_int ? 0x06 : 0x0a));
+      PutBig(col_data, add_string(c.name), 4);
+      row_width += is_int ? 8 : 4;
+    }
+    for (std::uint32_t r = 0; r < rows; ++r)
+      for (const auto& c : cols)
+        if (c.ints.empty()) PutBig(row_data, add_string(c.strs.at(r)), 4);
+        else PutBig(row_data, c.ints.at(r), 8);
+
+    auto rows_offset = 0x20 + col_data.size();
+    auto strings_offset = rows_offset + row_data.size();
+    auto size = strings_offset + strings.size();
+    std::string ret{"@UTF"};
+    PutBig(ret, size - 8, 4);
+    PutBig(ret, 0, 2);
+    PutBig(ret, rows_offset - 8, 2);
+    PutBig(ret, strings_offset - 8, 4);
+    PutBig(ret, size - 8, 4); // data
+    PutBig(ret, 0, 4); // table name
+    PutBig(ret, cols.size(), 2);
+    PutBig(ret, row_width, 2);
+    PutBig(ret, rows, 4);
+    return ret + col_data + row_data + strings;
+  }
+
+  // table header + @UTF table at offs
+  static void PutTable(
+    std::string& out, std::size_t offs, const char* magic, std::string utf)
+  {
+    REQUIRE(out.size() <= offs);
+    out.resize(offs, '\0');
+    out += magic;
+    PutBig(out, 0xff, 4);
+    for (unsigned i = 0; i < 8; ++i) out += char(utf.size() >> (i*8));
+    out += utf;
+  }
+
+  TEST_CASE("utf table")
+  {
+    auto data = UtfTestData(
+      {{"Int", {1, 0x123456789}, {}}, {"Str", {}, {"foo", ""}}}, 2);
+
+    auto check = [](std::string data)
+    {
+      UtfTable tbl{Libshit::Move(data)};
+      CHECK(tbl.GetRowCount() == 2);
+      CHECK(tbl.HasColumn("Int"));
+      CHECK(!tbl.HasColumn("Nope"));
+      CHECK(tbl.GetInt(1, "Int") == 0x123456789);
+      CHECK(tbl.GetString(0, "Str") == "foo");
+      CHECK(tbl.GetString(1, "Str") == "");
+      CHECK_THROWS(tbl.GetInt(0, "Str"));
+      CHECK_THROWS(tbl.GetString(0, "Nope"));
+    };
+    SUBCASE("plain") { check(data); }
+    SUBCASE("obfuscated")
+    {
+      DecryptUtf(data); // xor, it's its own inverse
+      check(data);
+    }
+    SUBCASE("truncated")
+    {
+      data.resize(data.size() - 1);
+      CHECK_THROWS(UtfTable{data});
+    }
+  }
+
+  static std::string CpkTestData(std::string dir = "dir")
+  {
+    static constexpr std::size_t TOC_OFFSET = 0x400, CONTENT_OFFSET = 0x800;
+    auto comp = CrilaylaTestData("xyzxyz");
+
+    std::string ret;
+    PutTable(ret, 0, "CPK ", UtfTestData(
+      {{"TocOffset", {TOC_OFFSET}, {}},
+       {"ContentOffset", {CONTENT_OFFSET}, {}}}, 1));
+    // offsets are relative to the toc, it comes first
+    PutTable(ret, TOC_OFFSET, "TOC ", UtfTestData(
+      {{"DirName", {}, {"", Libshit::Move(dir)}},
+       {"FileName", {}, {"a.txt", "b.bin"}},
+       {"FileOffset", {CONTENT_OFFSET - TOC_OFFSET,
+                       CONTENT_OFFSET - TOC_OFFSET + 0x10}, {}},
+       {"FileSize", {5, comp.size()}, {}},
+       {"ExtractSize", {5, CRILAYLA_RAW_SIZE + 6}, {}}}, 2));
+    REQUIRE(ret.size() <= CONTENT_OFFSET);
+    ret.resize(CONTENT_OFFSET, '\0');
+    ret += "hello";
+    ret.resize(CONTENT_OFFSET + 0x10, '\0');
+    return ret + comp;
+  }
+
+  static std::string ReadAll(const Source& src)
+  {
+    std::string ret(src.GetSize(), '\0');
+    src.Pread(0, ret.data(), ret.size());
+    return ret;
+  }
+
+  TEST_CASE("parse")
+  {
+    Cpk cpk{Source::FromMemory(CpkTestData())};
+    auto& es = cpk.GetEntries();
+    REQUIRE(es.size() == 2);
+    CHECK(es[0].name == "a.txt");
+    CHECK(!es[0].IsCompressed());
+    CHECK(es[1].name == "dir/b.bin");
+    CHECK(es[1].IsCompressed());
+    CHECK(cpk.FindEntry("dir/b.bin") == &es[1]);
+    CHECK(cpk.FindEntry("b.bin") == nullptr);
+
+    CHECK(ReadAll(cpk.GetSource("a.txt")) == "hello");
+    std::string exp;
+    for (std::size_t i = 0; i < CRILAYLA_RAW_SIZE; ++i) exp += char(i);
+    exp += "xyzxyz";
+    CHECK(ReadAll(cpk.GetSource("dir/b.bin")) == exp);
+    // from the cache
+    CHECK(ReadAll(cpk.GetSource("dir/b.bin")) == exp);
+    CHECK_THROWS(cpk.GetSource("nope"));
+
+    cpk.ExtractTo("tmp_cpk");
+    CHECK(ReadAll(Source::FromFile("tmp_cpk/a.txt")) == "hello");
+    CHECK(ReadAll(Source::FromFile("tmp_cpk/dir/b.bin")) == exp);
+    boost::filesystem::remove_all("tmp_cpk");
+  }
+
+  TEST_CASE("invalid cpk")
+  {
+    auto data = CpkTestData();
+    SUBCASE("table size overflow")
+    {
+      for (unsigned i = 0; i < 8; ++i) data[8+i] = '\xff';
+      CHECK_THROWS(Cpk{Source::FromMemory(data)});
+    }
+    SUBCASE("toc out of range")
+    {
+      data.resize(0x410);
+      CHECK_THROWS(Cpk{Source::FromMemory(data)});
+    }
+    SUBCASE("entry out of range")
+    {
+      data.resize(0x805);
+      CHECK_THROWS(Cpk{Source::FromMemory(data)});
+    }
+    SUBCASE("path traversal")
+    {
+      for (auto dir : {"..", "../x", "x/../..", "x\\..", "/x", "\\x", "c:x"})
+      {
+        CAPTURE(dir);
+        CHECK_THROWS_AS(Cpk{Source::FromMemory(CpkTestData(dir))},
+                        Libshit::DecodeError);
+      }
+      CHECK_NOTHROW(Cpk{Source::FromMemory(CpkTestData("x/..y"))});
+    }
+  }
+
+  TEST_CASE("crilayla invalid")
+  {
+    auto data = CrilaylaTestData("xyzxyz");
+    data[sizeof(CrilaylaHeader)] = '\xff'; // garbage bits
+    data[sizeof(CrilaylaHeader)+1] = '\xff';
+    auto src = DecompressCrilayla(Source::FromMemory(Libshit::Move(data)));
+    char buf[4];
+    CHECK_THROWS(src.Pread(0, buf, 4));
+  }
+
+  TEST_SUITE_END();
+}
+
+#include "cpk.binding.hpp"
@@ -0,0 +1,71 @@
+#ifndef UUID_8A918BA5_BA5A_4D7D_A566_3090054B7419
+#define UUID_8A918BA5_BA5A_4D7D_A566_3090054B7419
+#pragma once
+
+#include "../dumpable.hpp"
+#include "../source.hpp"
+
+#include <libshit/shared_ptr.hpp>
+
+#include <boost/filesystem/path.hpp>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace Neptools
+{
+
+  /// Read-only CRI CPK archive. Uncompressed entries are served as slices of
+  /// the archive, CRILAYLA compressed entries are decompressed on first access.
+  class Cpk final : public Libshit::RefCounted, public Dumpable
+  {
+    LIBSHIT_DYNAMIC_OBJECT;
+  public:
+    struct Entry
+    {
+      std::string name; // dir/file
+      FilePosition offset;
+      FilePosition size;
+      FilePosition extract_size;
+
+      bool IsCompressed() const noexcept { return size != extract_size; }
+    };
+
+    Cpk(Source src);
+
+    FilePosition GetSize() const override { return src.GetSize(); }
+
+    LIBSHIT_NOLUA const std::vector<Entry>& GetEntries() const noexcept
+    { return entries; }
+    LIBSHIT_NOLUA const Entry* FindEntry(std::string_view name) const noexcept;
+
+    Source GetSource(std::string_view name) const;
+    LIBSHIT_NOLUA Source GetSource(const Entry& e) const;
+
+    void ExtractTo(const boost::filesystem::path& dir) const;
+
+  private:
+    Source src;
+    std::vector<Entry> entries;
+    std::unordered_map<std::string_view, std::size_t> entry_map;
+
+    // recently opened compressed entries, so reopening one doesn't decompress
+    // it again. Front is the most recent.
+    static constexpr std::size_t CACHE_SIZE = 4;
+    mutable std::vector<std::pair<const Entry*, Source>> cache;
+
+    void Parse_();
+    void Dump_(Sink& sink) const override { src.Dump(sink); }
+    void Inspect_(std::ostream& os, unsigned indent) const override;
+  };
+
+  /// Source of a CRILAYLA packed entry. Decompression is deferred until the
+  /// first read, then the whole entry is kept in memory.
+  Source DecompressCrilayla(
+    const Source& src, boost::filesystem::path fname = {});
+
+}
+#endif
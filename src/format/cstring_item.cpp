@@ -8,8 +8,11 @@ namespace Neptools
 {
 
   CStringItem::CStringItem(Key k, Context& ctx, const Source& src)
-    : Item{k, ctx}, string{src.PreadCString(0)}
-  {}
+    : Item{k, ctx}
+  {
+    auto view = src.PreadCStringView(0, string);
+    if (view.data() != string.data()) string.assign(view);
+  }
 
   CStringItem& CStringItem::CreateAndInsert(ItemPointer ptr)
   {
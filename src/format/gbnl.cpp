@@ -1,4 +1,5 @@
 #include "gbnl_lua.hpp"
+#include "../binary_reader.hpp"
 #include "../open.hpp"
 #include "../sink.hpp"
 
@@ -6,14 +7,20 @@
 #include <libshit/char_utils.hpp>
 
 #include <map>
+#include <string_view>
+#include <vector>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/container/small_vector.hpp>
 #include <boost/preprocessor/repetition/repeat.hpp>
 #include <brigand/algorithms/wrap.hpp>
 
+#include <libshit/doctest.hpp>
+
 namespace Neptools
 {
+  TEST_SUITE_BEGIN("Neptools::Gbnl");
+
   static constexpr bool STRTOOL_COMPAT = false;
 
   namespace { enum class Separator { AUTO, SJIS, UTF8 }; }
@@ -123,15 +130,17 @@ namespace Neptools
     field_28 = foot.field_28;
     field_30 = foot.field_30;
 
-    src.Seek(foot.offset_types);
     msg_descr_size = foot.msg_descr_size;
     size_t calc_offs = 0;
 
+    std::string fallback;
+    BinaryReader types{src, foot.offset_types,
+        sizeof(TypeDescriptor) * foot.count_types, fallback};
     Struct::TypeBuilder bld;
     bool int8_in_progress = false;
     for (size_t i = 0; i < foot.count_types; ++i)
     {
-      auto type = src.ReadGen<TypeDescriptor>();
+      auto type = types.ReadGen<TypeDescriptor>();
       ToNative(type, endian);
       VALIDATE("unordered types", calc_offs <= type.offset);
 
@@ -168,38 +177,43 @@ namespace Neptools
     type = bld.Build();
 
     auto msgs = foot.descr_offset;
+    // descriptors are read sequentially, strings are right after them
+    src.Prefetch(msgs, src.GetSize() - msgs);
     messages.reserve(foot.count_msgs);
+    std::string msgs_fallback, str_fallback;
+    BinaryReader rd{src, msgs, FileMemSize(msg_descr_size) * foot.count_msgs,
+        msgs_fallback};
     for (size_t i = 0; i < foot.count_msgs; ++i)
     {
       messages.emplace_back(Struct::New(type));
       auto& m = messages.back();
-      src.Seek(msgs);
+      rd.Seek(msgs);
       for (size_t i = 0; i < type->item_count; ++i)
       {
         switch (type->items[i].idx)
         {
         case Struct::GetIndexFromType<int8_t>():
-          m->Get<int8_t>(i) = src.ReadUint8(endian);
+          m->Get<int8_t>(i) = rd.ReadUint8(endian);
           break;
         case Struct::GetIndexFromType<int16_t>():
-          m->Get<int16_t>(i) = src.ReadUint16(endian);
+          m->Get<int16_t>(i) = rd.ReadUint16(endian);
           break;
         case Struct::GetIndexFromType<int32_t>():
-          m->Get<int32_t>(i) = src.ReadUint32(endian);
+          m->Get<int32_t>(i) = rd.ReadUint32(endian);
           break;
         case Struct::GetIndexFromType<int64_t>():
-          m->Get<int64_t>(i) = src.ReadUint64(endian);
+          m->Get<int64_t>(i) = rd.ReadUint64(endian);
           break;
         case Struct::GetIndexFromType<float>():
         {
           union { float f; uint32_t i; } x;
-          x.i = src.ReadUint32(endian);
+          x.i = rd.ReadUint32(endian);
           m->Get<float>(i) = x.f;
           break;
         }
         case Struct::GetIndexFromType<OffsetString>():
         {
-          uint32_t offs = src.ReadUint32(endian);
+          uint32_t offs = rd.ReadUint32(endian);
           if (offs == 0xffffffff)
             m->Get<OffsetString>(i).offset = -1;
           else
@@ -207,15 +221,16 @@ namespace Neptools
             VALIDATE("", offs < src.GetSize() - foot.offset_msgs);
             auto str = foot.offset_msgs + offs;
 
-            m->Get<OffsetString>(i) = {src.PreadCString(str), 0};
+            m->Get<OffsetString>(i) = {
+              std::string{src.PreadCStringView(str, str_fallback)}, 0};
           }
           break;
         }
         case Struct::GetIndexFromType<FixStringTag>():
-          src.Read(m->Get<FixStringTag>(i).str, type->items[i].size);
+          rd.Read(m->Get<FixStringTag>(i).str, type->items[i].size);
           break;
         case Struct::GetIndexFromType<PaddingTag>():
-          src.Read(m->Get<PaddingTag>(i).pad, type->items[i].size);
+          rd.Read(m->Get<PaddingTag>(i).pad, type->items[i].size);
           break;
         }
       }
@@ -309,6 +324,35 @@ namespace Neptools
     };
   }
 
+  namespace
+  {
+    // assigns string offsets in order of first use
+    struct OffsetAssigner
+    {
+      void operator()(Gbnl::OffsetString& os)
+      {
+        if (os.offset == static_cast<uint32_t>(-1)) return;
+        auto x = map.emplace(os.str, offset);
+        if (x.second) // new item inserted
+        {
+          strs.push_back(os.str);
+          offset += os.str.size() + 1;
+        }
+        os.offset = x.first->second;
+      }
+
+      void operator()(Gbnl::Struct& m)
+      {
+        for (size_t i = 0; i < m.GetSize(); ++i)
+          if (m.Is<Gbnl::OffsetString>(i)) (*this)(m.Get<Gbnl::OffsetString>(i));
+      }
+
+      std::map<std::string_view, size_t> map;
+      std::vector<std::string_view> strs; // in offset order
+      size_t offset = 0;
+    };
+  }
+
   void Gbnl::Dump_(Sink& sink) const
   {
     if (is_gstl) DumpHeader(sink);
@@ -326,7 +370,60 @@ namespace Neptools
       m->ForEach(WriteDescr{msgd.data(), endian});
       sink.Write({reinterpret_cast<char*>(msgd.data()), msg_descr_size});
     }
+    DumpTypes(sink);
+
+    size_t offset = 0;
+    for (const auto& m : messages)
+      for (size_t i = 0; i < m->GetSize(); ++i)
+        if (m->Is<OffsetString>(i))
+        {
+          auto& ofs = m->Get<OffsetString>(i);
+          if (ofs.offset == offset)
+          {
+            sink.WriteCString(ofs.str);
+            offset += ofs.str.size() + 1;
+          }
+        }
+
+    LIBSHIT_ASSERT(offset == msgs_size);
+    auto offset_round = Align(offset);
+    sink.Pad(offset_round - offset);
+
+    if (!is_gstl) DumpHeader(sink);
+  }
+
+  // Same output as Fixup + Dump_, but string offsets are assigned while
+  // writing the message descriptors
+  void Gbnl::DumpStream_(Sink& sink)
+  {
+    RecalcTypeSize();
+    // the header only needs to know whether there are any strings
+    msgs_size = HasStrings();
+    if (is_gstl) DumpHeader(sink);
+
+    boost::container::small_vector<Byte, 392> msgd;
+    msgd.resize(msg_descr_size);
+    OffsetAssigner as;
+    for (auto& m : messages)
+    {
+      LIBSHIT_ASSERT(m->GetType() == type);
+      as(*m);
+      m->ForEach(WriteDescr{msgd.data(), endian});
+      sink.Write({reinterpret_cast<char*>(msgd.data()), msg_descr_size});
+    }
+    msgs_size = as.offset;
+    DumpTypes(sink);
+
+    // std::string's are null terminated
+    for (auto str : as.strs) sink.Write({str.data(), str.size() + 1});
+    sink.Pad(Align(msgs_size) - msgs_size);
+
+    if (!is_gstl) DumpHeader(sink);
+  }
 
+  // padded message descriptor end, type descriptors, padding
+  void Gbnl::DumpTypes(Sink& sink) const
+  {
     auto msgs_end = msg_descr_size * messages.size();
     auto msgs_end_round = Align(msgs_end);
     sink.Pad(msgs_end_round - msgs_end);
@@ -378,29 +475,11 @@ namespace Neptools
     auto control_end_round = Align(control_end);
     sink.Pad(control_end_round - control_end);
 
-    size_t offset = 0;
-    for (const auto& m : messages)
-      for (size_t i = 0; i < m->GetSize(); ++i)
-        if (m->Is<OffsetString>(i))
-        {
-          auto& ofs = m->Get<OffsetString>(i);
-          if (ofs.offset == offset)
-          {
-            sink.WriteCString(ofs.str);
-            offset += ofs.str.size() + 1;
-          }
-        }
-
-    LIBSHIT_ASSERT(offset == msgs_size);
-    auto offset_round = Align(offset);
-    sink.Pad(offset_round - offset);
-
     // sanity checks
     LIBSHIT_ASSERT(msgs_end_round == Align(msg_descr_size * messages.size()));
     LIBSHIT_ASSERT(
       control_end_round == Align(
         msgs_end_round + sizeof(TypeDescriptor) * real_item_count));
-    if (!is_gstl) DumpHeader(sink);
   }
 
   void Gbnl::DumpHeader(Sink& sink) const
@@ -498,7 +577,7 @@ namespace Neptools
     Indent(os, indent) << "})";
   }
 
-  void Gbnl::RecalcSize()
+  void Gbnl::RecalcTypeSize()
   {
     size_t len = 0, count = 0;
     for (size_t i = 0; i < type->item_count; ++i)
@@ -517,24 +596,28 @@ namespace Neptools
       }
     msg_descr_size = len;
     real_item_count = count;
+  }
 
-    std::map<std::string, size_t> offset_map;
-    size_t offset = 0;
+  void Gbnl::RecalcSize()
+  {
+    RecalcTypeSize();
+    OffsetAssigner as;
     for (auto& m : messages)
     {
       LIBSHIT_ASSERT(m->GetType() == type);
-      for (size_t i = 0; i < m->GetSize(); ++i)
-        if (m->Is<OffsetString>(i))
-        {
-          auto& os = m->Get<OffsetString>(i);
-          if (os.offset == static_cast<uint32_t>(-1)) continue;
-          auto x = offset_map.emplace(os.str, offset);
-          if (x.second) // new item inserted
-            offset += os.str.size() + 1;
-          os.offset = x.first->second;
-        }
+      as(*m);
     }
-    msgs_size = offset;
+    msgs_size = as.offset;
+  }
+
+  bool Gbnl::HasStrings() const
+  {
+    for (const auto& m : messages)
+      for (size_t i = 0; i < m->GetSize(); ++i)
+        if (m->Is<OffsetString>(i) &&
+            m->Get<OffsetString>(i).offset != static_cast<uint32_t>(-1))
+          return true;
+    return false;
   }
 
   FilePosition Gbnl::GetSize() const noexcept
@@ -737,6 +820,44 @@ namespace Neptools
       return nullptr;
     }};
 
+  TEST_CASE("stream dump")
+  {
+    Gbnl::Struct::TypeBuilder bld;
+    bld.Add<int32_t>();
+    bld.Add<Gbnl::OffsetString>();
+    bld.Add<int8_t>();
+    bld.Add<Gbnl::PaddingTag>(3);
+    bld.Add<Gbnl::OffsetString>();
+    auto type = bld.Build();
+
+    bool is_gstl = false;
+    SUBCASE("gbnl") {}
+    SUBCASE("gstl") { is_gstl = true; }
+    Gbnl gbnl{Endian::LITTLE, is_gstl, 0, 0, 0, type};
+    for (int i = 0; i < 3; ++i)
+    {
+      gbnl.messages.emplace_back(Gbnl::Struct::New(type));
+      auto& m = *gbnl.messages.back();
+      m.Get<int32_t>(0) = i;
+      m.Get<Gbnl::OffsetString>(1) = {"str" + std::to_string(i), 0};
+      m.Get<int8_t>(2) = i;
+      m.Get<Gbnl::OffsetString>(4) = {"", 0};
+    }
+    // repeated and missing strings
+    gbnl.messages[2]->Get<Gbnl::OffsetString>(1).str = "str0";
+    gbnl.messages[1]->Get<Gbnl::OffsetString>(4).offset = -1;
+
+    MemorySink stream;
+    gbnl.DumpStream(stream);
+
+    gbnl.Fixup();
+    REQUIRE(stream.Tell() == gbnl.GetSize());
+    MemorySink exp{gbnl.GetSize()};
+    gbnl.Dump(exp);
+    CHECK(stream.GetStringView() == exp.GetStringView());
+  }
+
+  TEST_SUITE_END();
 }
 
 #include <libshit/container/vector.lua.hpp>
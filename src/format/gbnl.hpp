@@ -111,13 +111,17 @@ namespace Neptools
     void Dump_(Sink& sink) const override;
     void InspectGbnl(std::ostream& os, unsigned indent) const;
     void Inspect_(std::ostream& os, unsigned indent) const override;
+    void ReadTxt_(std::istream& is) override;
 
   private:
     void WriteTxt_(std::ostream& os) const override;
-    void ReadTxt_(std::istream& is) override;
 
     void Parse_(Source& src);
+    void DumpStream_(Sink& sink) override;
     void DumpHeader(Sink& sink) const;
+    void DumpTypes(Sink& sink) const;
+    void RecalcTypeSize();
+    bool HasStrings() const;
     void Pad(uint16_t diff, Struct::TypeBuilder& bld, bool& int8_in_progress);
     FilePosition Align(FilePosition x) const noexcept;
 
@@ -50,6 +50,12 @@ namespace Libshit::Lua
     bld.AddFunction<
       static_cast<::Neptools::FilePosition (::Neptools::Item::*)() const noexcept>(&::Neptools::Item::GetPosition)
     >("get_position");
+    bld.AddFunction<
+      static_cast<void (::Neptools::Item::*)() noexcept>(&::Neptools::Item::MarkDirty)
+    >("mark_dirty");
+    bld.AddFunction<
+      static_cast<bool (::Neptools::Item::*)() const noexcept>(&::Neptools::Item::IsDirty)
+    >("is_dirty");
     bld.AddFunction<
       static_cast<void (::Neptools::Item::*)(const ::Libshit::NotNull<Libshit::RefCountedPtr<::Neptools::Item> > &)>(&::Neptools::Item::Replace<Check::Throw>)
     >("replace");
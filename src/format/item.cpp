@@ -1,5 +1,6 @@
 #include "item.hpp"
 #include "context.hpp"
+#include "cstring_item.hpp"
 #include "raw_item.hpp"
 #include "../utils.hpp"
 
@@ -12,11 +13,14 @@
 #  include "format/builder.lua.h"
 #endif
 
+#include <libshit/doctest.hpp>
+
 #define LIBSHIT_LOG_NAME "item"
 #include <libshit/logger_helper.hpp>
 
 namespace Neptools
 {
+  TEST_SUITE_BEGIN("Neptools::Item");
 
   Item::~Item()
   {
@@ -39,8 +43,27 @@ namespace Neptools
   {
     position = npos;
     Fixup();
+    dirty = false;
+  }
+
+  void Item::MarkDirty() noexcept
+  {
+    dirty = true;
+    // stop at the first parent that's already dirty and has no cached size:
+    // everything above it is in the same state
+    for (auto p = GetParent();
+         p && !(p->dirty && p->children_size == ItemWithChildren::INVALID_SIZE);
+         p = p->GetParent())
+    {
+      p->dirty = true;
+      p->children_size = ItemWithChildren::INVALID_SIZE;
+    }
   }
 
+  void Item::Shift(FilePosition delta) noexcept { position += delta; }
+  void Item::MarkClean() noexcept { dirty = false; }
+  void Item::MarkAllDirty() noexcept { dirty = true; }
+
   void Item::Replace_(const Libshit::NotNull<Libshit::SmartPtr<Item>>& nitem)
   {
     auto ctx = GetContext();
@@ -51,9 +74,7 @@ namespace Neptools
 
     // update pointermap
     nitem->position = position;
-    auto it = ctx->pmap.find(position);
-    if (it != ctx->pmap.end() && it->second == this)
-      it->second = nitem.get();
+    ctx->pmap.Replace(position, this, nitem.get());
 
     auto& list = GetParent()->GetChildren();
     auto self = Iterator();
@@ -66,9 +87,7 @@ namespace Neptools
   {
     auto ctx = GetContextMaybe();
     if (!ctx) return;
-    auto it = ctx->pmap.find(position);
-    if (it != ctx->pmap.end() && it->second == this)
-      ctx->pmap.erase(it);
+    ctx->pmap.Remove(position, this);
   }
 
   void Item::Slice(SliceSeq seq)
@@ -81,7 +100,7 @@ namespace Neptools
     LabelsContainer lbls{std::move(labels)};
     auto ctx = GetContext();
     auto& pmap = ctx->pmap;
-    auto empty = pmap.empty();
+    auto empty = pmap.Empty();
 
     auto& list = GetParent()->GetChildren();
     auto it = Iterator();
@@ -115,7 +134,7 @@ namespace Neptools
       if (!empty)
         // may throw! but only used during parsing, and an exception there
         // is fatal, so it's not really a problem
-        pmap.emplace(el.first->position, &*el.first);
+        pmap.Insert(el.first->position, &*el.first);
 
       offset = el.second;
     }
@@ -127,12 +146,8 @@ namespace Neptools
     LIBSHIT_ASSERT(labels.empty() && !GetParent());
     if (auto ctx = GetContextMaybe())
     {
-      auto it = ctx->pmap.find(position);
-      if (it != ctx->pmap.end() && it->second == this)
-      {
+      if (ctx->pmap.Remove(position, this))
         WARN << "Item " << this << " unlinked from pmap in Dispose" << std::endl;
-        ctx->pmap.erase(it);
-      }
     }
 
     context.reset();
@@ -166,10 +181,12 @@ namespace Neptools
 
   FilePosition ItemWithChildren::GetSize() const
   {
+    if (children_size != INVALID_SIZE) return children_size;
+
     FilePosition ret = 0;
     for (auto& c : GetChildren())
       ret += c.GetSize();
-    return ret;
+    return children_size = ret;
   }
 
   void ItemWithChildren::Fixup_(FilePosition offset)
@@ -177,9 +194,33 @@ namespace Neptools
     FilePosition pos = position + offset;
     for (auto& c : GetChildren())
     {
-      c.UpdatePosition(pos);
+      // fixes up the child's children first, so its GetSize is cached
+      if (c.dirty) c.UpdatePosition(pos);
+      // unchanged subtrees keep their layout, they only have to be moved
+      else if (c.position != pos) c.Shift(pos - c.position);
       pos += c.GetSize();
     }
+    children_size = pos - position - offset;
+  }
+
+  void ItemWithChildren::Shift(FilePosition delta) noexcept
+  {
+    Item::Shift(delta);
+    for (auto& c : GetChildren()) c.Shift(delta);
+  }
+
+  void ItemWithChildren::MarkClean() noexcept
+  {
+    for (auto& c : GetChildren()) c.MarkClean();
+    Item::MarkClean();
+    ItemWithChildren::GetSize();
+  }
+
+  void ItemWithChildren::MarkAllDirty() noexcept
+  {
+    for (auto& c : GetChildren()) c.MarkAllDirty();
+    Item::MarkAllDirty();
+    children_size = INVALID_SIZE;
   }
 
   void ItemWithChildren::MoveNextToChild(size_t size) noexcept
@@ -204,6 +245,116 @@ namespace Neptools
     for (auto& ch : GetChildren()) ch.Removed();
   }
 
+  namespace
+  {
+    struct TestContext final : Context
+    {
+      void Inspect_(std::ostream&, unsigned) const override {}
+    };
+    struct TestParent final : ItemWithChildren
+    {
+      using ItemWithChildren::ItemWithChildren;
+      void Inspect_(std::ostream&, unsigned) const override {}
+    };
+    struct CountingItem final : Item
+    {
+      CountingItem(Key k, Context& ctx, FilePosition size)
+        : Item{k, ctx}, size{size} {}
+      FilePosition GetSize() const noexcept override { return size; }
+      void Fixup() override { ++fixups; }
+      void Dump_(Sink&) const override {}
+      void Inspect_(std::ostream&, unsigned) const override {}
+
+      FilePosition size;
+      unsigned fixups = 0;
+    };
+  }
+
+  TEST_CASE("cached sizes")
+  {
+    auto ctx = Libshit::MakeSmart<TestContext>();
+    auto parent = ctx->Create<TestParent>();
+    auto str = ctx->Create<CStringItem>("foo");
+    ctx->GetChildren().push_back(*ctx->Create<RawItem>("abcd"));
+    ctx->GetChildren().push_back(*parent);
+    parent->GetChildren().push_back(*ctx->Create<RawItem>("xy"));
+    parent->GetChildren().push_back(*str);
+    CHECK(parent->GetSize() == 6);
+    CHECK(ctx->GetSize() == 10);
+
+    // list changes invalidate every parent
+    parent->GetChildren().push_back(*ctx->Create<RawItem>("zz"));
+    CHECK(ctx->GetSize() == 12);
+    parent->GetChildren().pop_front();
+    CHECK(ctx->GetSize() == 10);
+
+    str->string = "foobar";
+    str->MarkDirty();
+    CHECK(parent->GetSize() == 9);
+    CHECK(ctx->GetSize() == 13);
+
+    str->string = "f";
+    str->MarkDirty();
+    ctx->Fixup();
+    CHECK(ctx->GetSize() == 8);
+    CHECK(parent->GetPosition() == 4);
+    CHECK(str->GetPosition() == 4);
+    CHECK(parent->GetChildren().back().GetPosition() == 6);
+  }
+
+  TEST_CASE("incremental fixup")
+  {
+    auto ctx = Libshit::MakeSmart<TestContext>();
+    auto a = ctx->Create<CountingItem>(4);
+    auto parent = ctx->Create<TestParent>();
+    auto b = ctx->Create<CountingItem>(2);
+    auto c = ctx->Create<CountingItem>(3);
+    auto d = ctx->Create<CountingItem>(1);
+    ctx->GetChildren().push_back(*a);
+    ctx->GetChildren().push_back(*parent);
+    parent->GetChildren().push_back(*b);
+    parent->GetChildren().push_back(*c);
+    ctx->GetChildren().push_back(*d);
+
+    ctx->Fixup();
+    CHECK(!ctx->IsDirty()); CHECK(!parent->IsDirty()); CHECK(!c->IsDirty());
+    CHECK(a->fixups == 1); CHECK(c->fixups == 1); CHECK(d->fixups == 1);
+    CHECK(d->GetPosition() == 9);
+
+    // nothing changed
+    ctx->FixupDirty();
+    CHECK(a->fixups == 1); CHECK(c->fixups == 1); CHECK(d->fixups == 1);
+
+    b->size = 5;
+    b->MarkDirty();
+    CHECK(ctx->IsDirty()); CHECK(parent->IsDirty()); CHECK(!c->IsDirty());
+    ctx->FixupDirty();
+    // only the changed item is fixed up, the ones after it are moved
+    CHECK(a->fixups == 1); CHECK(b->fixups == 2); CHECK(c->fixups == 1);
+    CHECK(d->fixups == 1);
+    CHECK(c->GetPosition() == 9);
+    CHECK(d->GetPosition() == 12);
+    CHECK(ctx->GetSize() == 13);
+
+    // removing moves the rest back
+    parent->GetChildren().pop_front();
+    ctx->FixupDirty();
+    CHECK(c->fixups == 1); CHECK(d->fixups == 1);
+    CHECK(c->GetPosition() == 4);
+    CHECK(d->GetPosition() == 7);
+
+    // unmarked changes are only picked up by a full Fixup
+    a->size = 1;
+    ctx->FixupDirty();
+    CHECK(d->GetPosition() == 7);
+    ctx->Fixup();
+    CHECK(a->fixups == 2); CHECK(c->fixups == 2); CHECK(d->fixups == 2);
+    CHECK(c->GetPosition() == 1);
+    CHECK(d->GetPosition() == 4);
+    CHECK(ctx->GetSize() == 5);
+  }
+
+  TEST_SUITE_END();
 }
 
 #include <libshit/container/parent_list.lua.hpp>
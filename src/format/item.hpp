@@ -42,6 +42,13 @@ namespace Neptools
     void operator=(const Item&) = delete;
     virtual ~Item();
 
+    /// Allocated from the context's arena when created by Context::Create.
+    LIBSHIT_NOLUA static void* operator new(std::size_t size)
+    { return Arena::Allocate(size); }
+    LIBSHIT_NOLUA static void operator delete(
+      void* ptr, std::size_t size) noexcept
+    { Arena::Free(ptr, size); }
+
     Libshit::RefCountedPtr<Context> GetContextMaybe() noexcept
     { return context.lock(); }
     Libshit::NotNull<Libshit::RefCountedPtr<Context>> GetContext()
@@ -64,6 +71,14 @@ namespace Neptools
 
     FilePosition GetPosition() const noexcept { return position; }
 
+    /// Call after changing this item in a way that can change its size or
+    /// layout (outside of Fixup). Context::FixupDirty only relayouts dirty
+    /// items and moves the ones after them, and parents cache the size of
+    /// their children.
+    /// New items and items in a changed list are handled automatically.
+    void MarkDirty() noexcept;
+    bool IsDirty() const noexcept { return dirty; }
+
     template <typename Checker = Libshit::Check::Assert>
     void Replace(const Libshit::NotNull<Libshit::RefCountedPtr<Item>>& nitem)
     {
@@ -108,9 +123,16 @@ namespace Neptools
     Libshit::WeakRefCountedPtr<Context> context;
 
     LabelsContainer labels;
+    // this item or something below it needs a Fixup. If an item is dirty, its
+    // parents are dirty too.
+    bool dirty = true;
 
     void Replace_(const Libshit::NotNull<Libshit::RefCountedPtr<Item>>& nitem);
     virtual void Removed();
+    /// Move an already fixed up item by delta.
+    virtual void Shift(FilePosition delta) noexcept;
+    virtual void MarkClean() noexcept;
+    virtual void MarkAllDirty() noexcept;
 
     friend class Context;
     friend struct ItemListTraits;
@@ -127,10 +149,8 @@ namespace Neptools
   using ItemList = Libshit::ParentList<Item, ItemListTraits>;
   struct ItemListTraits
   {
-    static void add(ItemList&, Item& item) noexcept
-    { item.AddRef(); }
-    static void remove(ItemList&, Item& item) noexcept
-    { item.Removed(); item.RemoveRef(); }
+    static void add(ItemList& list, Item& item) noexcept;
+    static void remove(ItemList& list, Item& item) noexcept;
   };
 
   inline auto Item::Iterator() const noexcept
@@ -148,7 +168,9 @@ namespace Neptools
     ItemList& GetChildren() noexcept { return *this; }
     LIBSHIT_NOLUA const ItemList& GetChildren() const noexcept { return *this; }
 
+    /// Cached, O(1) unless the children changed since the last call.
     FilePosition GetSize() const override;
+    /// Only fixes up dirty children, and moves the rest if needed.
     void Fixup() override { Fixup_(0); }
 
     LIBSHIT_NOLUA void MoveNextToChild(size_t size) noexcept;
@@ -161,10 +183,21 @@ namespace Neptools
     void Fixup_(FilePosition offset);
 
   private:
+    static constexpr FilePosition INVALID_SIZE = -1;
+    // sum of the children's sizes, INVALID_SIZE if not known. If a parent's
+    // cache is valid, the caches below it are valid too.
+    mutable FilePosition children_size = INVALID_SIZE;
+    void ChildrenChanged() noexcept
+    { children_size = INVALID_SIZE; MarkDirty(); }
+
     void Removed() override;
+    void Shift(FilePosition delta) noexcept override;
+    void MarkClean() noexcept override;
+    void MarkAllDirty() noexcept override;
 
     friend struct ::Neptools::ItemListTraits;
     friend class Item;
+    friend class Context;
   } LIBSHIT_LUAGEN(post_register=[[
     LIBSHIT_LUA_RUNBC(bld, builder, 1);
     bld.SetField("build");
@@ -175,6 +208,18 @@ namespace Neptools
   inline const ItemWithChildren* Item::GetParent() const noexcept
   { return static_cast<const ItemWithChildren*>(ItemList::opt_get_parent(*this)); }
 
+  inline void ItemListTraits::add(ItemList& list, Item& item) noexcept
+  {
+    item.AddRef();
+    static_cast<ItemWithChildren&>(list).ChildrenChanged();
+  }
+  inline void ItemListTraits::remove(ItemList& list, Item& item) noexcept
+  {
+    static_cast<ItemWithChildren&>(list).ChildrenChanged();
+    item.Removed();
+    item.RemoveRef();
+  }
+
 }
 
 #if LIBSHIT_WITH_LUA
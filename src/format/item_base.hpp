@@ -2,6 +2,7 @@
 #define UUID_02043882_EC07_4CCA_BD13_1BB9F5C7DB9F
 #pragma once
 
+#include "arena.hpp"
 #include "../utils.hpp"
 
 #include <libshit/assert.hpp>
@@ -16,6 +17,7 @@
 #include <cstdint>
 #include <functional>
 #include <boost/intrusive/set_hook.hpp>
+#include <boost/intrusive/unordered_set_hook.hpp>
 
 namespace Neptools LIBSHIT_META("alias_file src/format/item.hpp")
 {
@@ -72,9 +74,9 @@ namespace Neptools LIBSHIT_META("alias_file src/format/item.hpp")
     }
   };
 
-  using LabelNameHook = boost::intrusive::set_base_hook<
+  using LabelNameHook = boost::intrusive::unordered_set_base_hook<
     boost::intrusive::tag<struct NameTag>,
-    boost::intrusive::optimize_size<true>, Libshit::LinkMode>;
+    boost::intrusive::store_hash<true>, Libshit::LinkMode>;
   using LabelOffsetHook = boost::intrusive::set_base_hook<
     boost::intrusive::tag<struct OffsetTag>,
     boost::intrusive::optimize_size<true>, Libshit::LinkMode>;
@@ -89,6 +91,12 @@ namespace Neptools LIBSHIT_META("alias_file src/format/item.hpp")
     Label(std::string name, ItemPointer ptr)
       : name{std::move(name)}, ptr{ptr} {}
 
+    LIBSHIT_NOLUA static void* operator new(std::size_t size)
+    { return Arena::Allocate(size); }
+    LIBSHIT_NOLUA static void operator delete(
+      void* ptr, std::size_t size) noexcept
+    { Arena::Free(ptr, size); }
+
     const std::string& GetName() const { return name; }
     const ItemPointer& GetPtr() const { return ptr; }
 
@@ -102,11 +110,11 @@ namespace Neptools LIBSHIT_META("alias_file src/format/item.hpp")
   using LabelPtr = Libshit::RefCountedPtr<Label>;
   using WeakLabelPtr = Libshit::WeakRefCountedPtr<Label>;
 
-  // to be used by boost::intrusive::set
+  // to be used by boost::intrusive::unordered_set
   struct LabelKeyOfValue
   {
     using type = std::string;
-    const type& operator()(const Label& l) { return l.GetName(); }
+    const type& operator()(const Label& l) const { return l.GetName(); }
   };
 
   struct LabelOffsetKeyOfValue
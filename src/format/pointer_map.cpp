@@ -0,0 +1,246 @@
+#include "pointer_map.hpp"
+
+#include <libshit/assert.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <random>
+
+#include <libshit/doctest.hpp>
+
+namespace Neptools
+{
+  TEST_SUITE_BEGIN("Neptools::PointerMap");
+
+  // 4KiB of entries
+  static constexpr std::size_t BLOCK_SIZE = 256;
+
+  namespace
+  {
+    struct EntryLess
+    {
+      template <typename T>
+      bool operator()(const T& a, FilePosition b) const noexcept
+      { return a.first < b; }
+      template <typename T>
+      bool operator()(FilePosition a, const T& b) const noexcept
+      { return a < b.first; }
+    };
+  }
+
+  void PointerMap::Clear() noexcept
+  {
+    // only used while parsing, free the memory
+    blocks = {};
+  }
+
+  std::size_t PointerMap::FindBlock(FilePosition pos) const noexcept
+  {
+    LIBSHIT_ASSERT(!blocks.empty());
+    auto it = std::upper_bound(
+      blocks.begin(), blocks.end(), pos,
+      [](FilePosition p, const Block& b) { return p < b.first; });
+    return it == blocks.begin() ? 0 : it - blocks.begin() - 1;
+  }
+
+  auto PointerMap::Find(FilePosition pos) noexcept -> Entry*
+  {
+    if (blocks.empty()) return nullptr;
+    auto& es = blocks[FindBlock(pos)].entries;
+    auto it = std::lower_bound(es.begin(), es.end(), pos, EntryLess{});
+    return it != es.end() && it->first == pos ? &*it : nullptr;
+  }
+
+  void PointerMap::Insert(FilePosition pos, Item* item)
+  {
+    if (blocks.empty())
+    {
+      std::vector<Entry> es;
+      es.reserve(BLOCK_SIZE);
+      es.push_back({pos, item});
+      blocks.push_back({pos, std::move(es)});
+      return;
+    }
+
+    auto bi = FindBlock(pos);
+    auto* es = &blocks[bi].entries;
+    auto it = std::lower_bound(es->begin(), es->end(), pos, EntryLess{});
+    if (it != es->end() && it->first == pos) return;
+
+    if (es->size() == BLOCK_SIZE)
+    {
+      // split the full block. When appending to the last block, leave it
+      // full, so parsing in order produces full blocks.
+      auto split = it == es->end() && bi == blocks.size() - 1 ?
+        es->end() : es->begin() + BLOCK_SIZE / 2;
+      std::vector<Entry> nes;
+      nes.reserve(BLOCK_SIZE);
+      nes.assign(split, es->end());
+      auto nfirst = nes.empty() ? pos : nes.front().first;
+      blocks.insert(blocks.begin() + bi + 1, {nfirst, std::move(nes)});
+
+      // can't throw from here, the blocks have BLOCK_SIZE capacity
+      auto& lo = blocks[bi].entries;
+      lo.resize(lo.size() - blocks[bi+1].entries.size());
+      if (pos >= nfirst) ++bi;
+      es = &blocks[bi].entries;
+      it = std::lower_bound(es->begin(), es->end(), pos, EntryLess{});
+    }
+
+    es->insert(it, {pos, item});
+    blocks[bi].first = es->front().first;
+  }
+
+  bool PointerMap::Remove(FilePosition pos, const Item* item) noexcept
+  {
+    if (blocks.empty()) return false;
+    auto bi = FindBlock(pos);
+    auto& es = blocks[bi].entries;
+    auto it = std::lower_bound(es.begin(), es.end(), pos, EntryLess{});
+    if (it == es.end() || it->first != pos || it->second != item) return false;
+
+    es.erase(it);
+    if (es.empty()) blocks.erase(blocks.begin() + bi);
+    else blocks[bi].first = es.front().first;
+    return true;
+  }
+
+  void PointerMap::Replace(
+    FilePosition pos, const Item* old, Item* nitem) noexcept
+  {
+    auto e = Find(pos);
+    if (e && e->second == old) e->second = nitem;
+  }
+
+  std::pair<FilePosition, Item*> PointerMap::Floor(
+    FilePosition pos) const noexcept
+  {
+    if (blocks.empty() || pos < blocks.front().first) return {0, nullptr};
+    auto& es = blocks[FindBlock(pos)].entries;
+    // es.front().first <= pos, so this is not begin
+    return *std::prev(std::upper_bound(es.begin(), es.end(), pos, EntryLess{}));
+  }
+
+  namespace
+  {
+    // what parsing does: split items (mostly going forward in the file if
+    // forward is set, at random positions otherwise), look up labels and
+    // replace the split items
+    template <typename Insert, typename Remove, typename Floor>
+    void RandomOps(std::size_t n, std::uint32_t seed, bool forward,
+                   Insert insert, Remove remove, Floor floor)
+    {
+      std::mt19937 gen{seed};
+      std::uniform_int_distribution<FilePosition> dist{0, n * 64};
+      FilePosition cur = 0;
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        auto pos = dist(gen);
+        if (forward && i % 4 != 0) pos = cur += 1 + pos % 64;
+        auto item = reinterpret_cast<Item*>(std::uintptr_t(pos * 8 + 8));
+        insert(pos, item);
+        floor(dist(gen));
+        if (i % 8 == 0)
+        {
+          remove(pos, item);
+          insert(pos, item);
+        }
+      }
+    }
+  }
+
+  TEST_CASE("random operations")
+  {
+    PointerMap pm;
+    std::map<FilePosition, Item*> ref;
+    CHECK(pm.Empty());
+
+    RandomOps(
+      20000, 7, false,
+      [&](FilePosition pos, Item* item)
+      {
+        pm.Insert(pos, item);
+        ref.emplace(pos, item);
+      },
+      [&](FilePosition pos, Item* item)
+      {
+        auto it = ref.find(pos);
+        bool exp = it != ref.end() && it->second == item;
+        if (exp) ref.erase(it);
+        REQUIRE(pm.Remove(pos, item) == exp);
+      },
+      [&](FilePosition pos)
+      {
+        auto it = ref.upper_bound(pos);
+        std::pair<FilePosition, Item*> exp{0, nullptr};
+        if (it != ref.begin()) exp = *std::prev(it);
+        REQUIRE(pm.Floor(pos) == exp);
+      });
+
+    CHECK(!pm.Empty());
+    CHECK(!pm.Remove(ref.begin()->first, nullptr));
+    for (auto& e : ref) REQUIRE(pm.Remove(e.first, e.second));
+    CHECK(pm.Empty());
+    CHECK(pm.Floor(1000).second == nullptr);
+  }
+
+  TEST_CASE("replace")
+  {
+    PointerMap pm;
+    Item* a = reinterpret_cast<Item*>(8);
+    Item* b = reinterpret_cast<Item*>(16);
+    pm.Insert(10, a);
+    pm.Insert(10, b);
+    CHECK(pm.Floor(12).first == 10);
+    CHECK(pm.Floor(12).second == a);
+    pm.Replace(10, b, b);
+    CHECK(pm.Floor(12).second == a);
+    pm.Replace(10, a, b);
+    CHECK(pm.Floor(12).second == b);
+    pm.Clear();
+    CHECK(pm.Empty());
+  }
+
+  // compares with std::map, not run by default (--no-skip)
+  TEST_CASE("pointer map benchmark" * doctest::skip())
+  {
+    static constexpr std::size_t N = 200000;
+    auto run = [](const char* name, bool forward, auto insert, auto remove,
+                  auto floor)
+    {
+      auto start = std::chrono::steady_clock::now();
+      RandomOps(N, 1, forward, insert, remove, floor);
+      std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+      MESSAGE(name << (forward ? " forward: " : " random: ")
+              << time.count() * 1000 << " ms");
+    };
+
+    std::size_t found = 0;
+    for (bool forward : {false, true})
+    {
+      std::map<FilePosition, Item*> map;
+      run("std::map", forward,
+          [&](FilePosition pos, Item* item) { map.emplace(pos, item); },
+          [&](FilePosition pos, Item* item)
+          {
+            auto it = map.find(pos);
+            if (it != map.end() && it->second == item) map.erase(it);
+          },
+          [&](FilePosition pos)
+          { found += map.upper_bound(pos) != map.begin(); });
+
+      PointerMap pm;
+      run("PointerMap", forward,
+          [&](FilePosition pos, Item* item) { pm.Insert(pos, item); },
+          [&](FilePosition pos, Item* item) { pm.Remove(pos, item); },
+          [&](FilePosition pos) { found += pm.Floor(pos).second != nullptr; });
+    }
+    CHECK(found > 0);
+  }
+
+  TEST_SUITE_END();
+}
@@ -0,0 +1,55 @@
+#ifndef UUID_C3F62855_9B1E_43A7_8A26_DFD4B531C33E
+#define UUID_C3F62855_9B1E_43A7_8A26_DFD4B531C33E
+#pragma once
+
+#include "../utils.hpp"
+
+#include <utility>
+#include <vector>
+
+namespace Neptools
+{
+
+  class Item;
+
+  /// Sorted FilePosition -> Item* map used during parsing. A two level B-tree:
+  /// entries are stored in sorted blocks of limited size, found by binary
+  /// searching the flat array of blocks by their first positions. Inserts
+  /// only move entries inside one block (and rarely the blocks), lookups touch
+  /// two contiguous arrays instead of walking tree nodes, and appending in
+  /// order (what parsers mostly do) fills blocks completely.
+  class PointerMap
+  {
+  public:
+    bool Empty() const noexcept { return blocks.empty(); }
+    void Clear() noexcept;
+
+    /// Add pos -> item, unless pos already has an item.
+    void Insert(FilePosition pos, Item* item);
+    /// Remove pos if it points to item. Returns whether it was removed.
+    bool Remove(FilePosition pos, const Item* item) noexcept;
+    /// Change pos to point to nitem if it points to old.
+    void Replace(FilePosition pos, const Item* old, Item* nitem) noexcept;
+
+    /// The entry with the largest position not greater than pos, or
+    /// {0, nullptr} if there's none.
+    std::pair<FilePosition, Item*> Floor(FilePosition pos) const noexcept;
+
+  private:
+    using Entry = std::pair<FilePosition, Item*>;
+    struct Block
+    {
+      FilePosition first; // entries.front().first
+      std::vector<Entry> entries; // never empty
+    };
+
+    /// Index of the block that should contain pos. There must be a block.
+    std::size_t FindBlock(FilePosition pos) const noexcept;
+    Entry* Find(FilePosition pos) noexcept;
+
+    std::vector<Block> blocks;
+  };
+
+}
+
+#endif
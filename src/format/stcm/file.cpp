@@ -19,6 +19,7 @@ namespace Neptools::Stcm
     SetupParseFrom(*root);
     root->Split(root->GetSize(), Create<EofItem>());
     HeaderItem::CreateAndInsert({root.get(), 0});
+    ParseDone();
   }
 
   void File::Inspect_(std::ostream& os, unsigned indent) const
@@ -51,6 +51,8 @@ namespace Neptools::Stcm
     }
 
     void Dump_(Sink& sink) const override { Gbnl::Dump_(sink); }
+    void ReadTxt_(std::istream& is) override
+    { MarkDirty(); Gbnl::ReadTxt_(is); }
     void Inspect_(std::ostream& os, unsigned indent) const override
     { Item::Inspect_(os, indent); Gbnl::InspectGbnl(os, indent); }
   };
@@ -6,6 +6,8 @@
 
 #include <libshit/char_utils.hpp>
 
+#include <cstring>
+
 namespace Neptools::Stcm
 {
 
@@ -20,19 +22,22 @@ namespace Neptools::Stcm
     auto child = dynamic_cast<RawItem*>(&it.GetChildren().front());
     if (!child || child->GetSize() != it.offset_unit * 4) return nullptr;
 
+    // only allocate the string when we're sure it's a string data
     auto src = child->GetSource();
-    auto s = src.ReadCString();
-    auto padlen = it.offset_unit * 4 - s.size() - 1;
+    std::string fallback;
+    auto data = src.GetContiguous(0, src.GetSize(), fallback);
+    auto len = strnlen(data.data(), data.size());
+    if (len == data.size()) return nullptr; // not null terminated
+    auto padlen = data.size() - len - 1;
     if (padlen > 4) return nullptr;
-    char pad[4];
-    src.Read(pad, padlen);
     // check padding all zero. I don't think it's required, but in the game
     // files they're zero filled, + dump will generate zeros, so do not lose
     // information by discarding a non-null padding...
-    for (size_t i = 0; i < padlen; ++i)
-      if (pad[i] != 0) return nullptr;
+    for (size_t i = len + 1; i < data.size(); ++i)
+      if (data[i] != 0) return nullptr;
 
-    auto sit = it.GetContext()->Create<StringDataItem>(Libshit::Move(s));
+    auto sit = it.GetContext()->Create<StringDataItem>(
+      std::string{data.substr(0, len)});
     it.Replace(sit);
     return Libshit::Move(sit);
   }
@@ -21,6 +21,7 @@ namespace Neptools::Stsc
     SetupParseFrom(*root);
     root->Split(root->GetSize(), Create<EofItem>());
     HeaderItem::CreateAndInsert({&*root, 0}, flavor);
+    ParseDone();
   }
 
   void File::Inspect_(std::ostream& os, unsigned indent) const
@@ -67,6 +68,7 @@ namespace Neptools::Stsc
         LIBSHIT_ASSERT(msg.empty() || msg.substr(msg.length()-2) == "\\n");
         if (!msg.empty()) { msg.pop_back(); msg.pop_back(); }
         static_cast<CStringItem&>(*it).string = std::move(msg);
+        it->MarkDirty();
 
         ++it;
         while (it != end && !dynamic_cast<CStringItem*>(&*it)) ++it;
@@ -2,6 +2,7 @@
 #include "instruction.hpp"
 #include "../context.hpp"
 #include "../raw_item.hpp"
+#include "../../binary_reader.hpp"
 #include "../../sink.hpp"
 
 #include <libshit/char_utils.hpp>
@@ -15,13 +16,17 @@ namespace Neptools::Stsc
     VALIDATE(memcmp(magic, "STSC", 4) == 0);
     VALIDATE(entry_point < size - 1);
     VALIDATE((flags & ~0x07) == 0);
+    VALIDATE(entry_point >= GetFullSize());
+#undef VALIDATE
+  }
 
+  FilePosition HeaderItem::Header::GetFullSize() const noexcept
+  {
     FilePosition hdr_len = sizeof(Header);
     if (flags & 1) hdr_len += 32;
     if (flags & 2) hdr_len += sizeof(ExtraHeader2Ser);
     if (flags & 4) hdr_len += 2; // uint16_t
-    VALIDATE(entry_point >= hdr_len);
-#undef VALIDATE
+    return hdr_len;
   }
 
   HeaderItem::HeaderItem(Key k, Context& ctx, Source src)
@@ -75,20 +80,25 @@ namespace Neptools::Stsc
 
     entry_point = ctx.CreateLabelFallback("entry_point", hdr.entry_point);
 
+    // Validate checked that the extra headers end before the entry point
+    std::string fallback;
+    BinaryReader rd{
+      src, src.Tell(), hdr.GetFullSize() - sizeof(Header), fallback};
     if (hdr.flags & 1)
     {
       extra_headers_1.emplace();
-      src.ReadGen(*extra_headers_1);
+      rd.ReadGen(*extra_headers_1);
     }
     if (hdr.flags & 2)
     {
-      auto eh2 = src.ReadGen<ExtraHeader2Ser>();
+      auto eh2 = rd.ReadGen<ExtraHeader2Ser>();
       extra_headers_2.emplace(
         eh2.field_0, eh2.field_2, eh2.field_4, eh2.field_6, eh2.field_8,
         eh2.field_a, eh2.field_c);
     }
     if (hdr.flags & 4)
-      extra_headers_4 = src.ReadLittleUint16();
+      extra_headers_4 = rd.ReadLittleUint16();
+    src.Seek(rd.Tell());
   }
 
   void HeaderItem::Dump_(Sink& sink) const
@@ -24,6 +24,8 @@ namespace Neptools::Stsc
       boost::endian::little_uint32_t flags;
 
       void Validate(FilePosition size) const;
+      /// Size including the extra headers selected by flags
+      FilePosition GetFullSize() const noexcept;
     };
     static_assert(sizeof(Header) == 12);
 
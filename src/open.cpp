@@ -1,4 +1,5 @@
 #include "open.hpp"
+#include "zstd.hpp"
 
 #include <libshit/except.hpp>
 
@@ -7,6 +8,8 @@ namespace Neptools
 
   auto OpenFactory::Open(Source src) -> Libshit::NotNull<Ret>
   {
+    // zstd compressed files are opened as their content
+    src = MaybeDecompressZstd(Libshit::Move(src));
     for (auto& x : GetStore())
     {
       auto ret = x(src);
@@ -23,6 +26,18 @@ namespace Neptools
       "File name", fname.string());
   }
 
+  auto OpenFactory::Open(const std::vector<boost::filesystem::path>& fnames)
+    -> Libshit::NotNull<Ret>
+  {
+    std::vector<Source> srcs;
+    srcs.reserve(fnames.size());
+    for (const auto& f : fnames)
+      LIBSHIT_ADD_INFOS(
+        srcs.push_back(Source::FromFile(f.native())),
+        "File name", f.string());
+    return Open(Source::Concat(srcs));
+  }
+
 }
 
 #include "open.binding.hpp"
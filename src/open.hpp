@@ -34,6 +34,9 @@ namespace Neptools
 
     static Libshit::NotNull<Ret> Open(Source src);
     static Libshit::NotNull<Ret> Open(const boost::filesystem::path& fname);
+    /// Open files split into multiple parts as one (see Source::Concat).
+    LIBSHIT_NOLUA static Libshit::NotNull<Ret> Open(
+      const std::vector<boost::filesystem::path>& fnames);
   };
 
 }
@@ -1,5 +1,6 @@
 #include "../format/item.hpp"
 #include "../format/cl3.hpp"
+#include "../format/cpk.hpp"
 #include "../format/primitive_item.hpp"
 #include "../format/stcm/file.hpp"
 #include "../format/stcm/gbnl.hpp"
@@ -8,6 +9,7 @@
 #include "../open.hpp"
 #include "../txt_serializable.hpp"
 #include "../utils.hpp"
+#include "../zstd.hpp"
 #include "version.hpp"
 
 #include <libshit/except.hpp>
@@ -42,25 +44,31 @@ namespace
     Cl3* cl3;
     Stcm::File* stcm;
     TxtSerializable* txt;
+    Cpk* cpk;
   };
 }
 
-static State SmartOpen(const boost::filesystem::path& fname)
+static State MakeState(SmartPtr<Dumpable> x)
 {
-  auto x = OpenFactory::Open(fname);
-  return {x, dynamic_cast<Cl3*>(x.get()), dynamic_cast<Stcm::File*>(x.get()),
-      dynamic_cast<TxtSerializable*>(x.get())};
+  auto p = x.get();
+  return {Move(x), dynamic_cast<Cl3*>(p), dynamic_cast<Stcm::File*>(p),
+      dynamic_cast<TxtSerializable*>(p), dynamic_cast<Cpk*>(p)};
 }
 
+static State SmartOpen(const boost::filesystem::path& fname)
+{ return MakeState(OpenFactory::Open(fname)); }
+static State SmartOpen(Source src)
+{ return MakeState(OpenFactory::Open(Move(src))); }
+
 template <typename T>
-static void ShellDump(const T* item, const char* name)
+static void ShellDump(T* item, const char* name)
 {
-  RefCountedPtr<Sink> sink;
+  // the size of stdout is not known in advance, dump it in one pass
   if (name[0] == '-' && name[1] == '\0')
-    sink = Sink::ToStdOut();
-  else
-    sink = Sink::ToFile(name, item->GetSize());
-  item->Dump(*sink);
+    return item->DumpStream(*Sink::ToStdOut());
+
+  item->Fixup();
+  item->Dump(*Sink::ToFile(name, item->GetSize()));
 }
 
 template <typename T, typename Fun>
@@ -149,6 +157,20 @@ namespace
   } mode = Mode::AUTO_STRTOOL;
 }
 
+// ext + suffix, or a zstd compressed ext (like .cl3.zst.txt)
+static bool HasExt(
+  const boost::filesystem::path& p, const std::string& ext, const char* suffix)
+{
+  return boost::iends_with(p.native(), ext + suffix) ||
+    boost::iends_with(p.native(), ext + ".zst" + suffix);
+}
+
+static bool HasBinExt(const boost::filesystem::path& p, const char* suffix)
+{
+  return HasExt(p, ".cl3", suffix) || HasExt(p, ".gbin", suffix) ||
+    HasExt(p, ".gstr", suffix) || HasExt(p, ".bin", suffix);
+}
+
 static auto BaseDoAutoFun(const boost::filesystem::path& p, const char* ext)
 {
   boost::filesystem::path cl3, txt;
@@ -179,8 +201,13 @@ static void DoAutoTxt(const boost::filesystem::path& p)
   if (import)
   {
     st.txt->ReadTxt(OpenIn(txt));
-    if (st.stcm) st.stcm->Fixup();
-    st.dump->Fixup();
+    // only the imported strings changed and ReadTxt marked them dirty
+    if (auto ctx = dynamic_cast<Context*>(st.dump.get())) ctx->FixupDirty();
+    else
+    {
+      if (st.stcm) st.stcm->Fixup();
+      st.dump->Fixup();
+    }
     st.dump->Dump(cl3);
   }
   else
@@ -205,10 +232,9 @@ static void DoAutoLua(const boost::filesystem::path& p)
     auto dmp = vm.Get<NotNull<SmartPtr<Dumpable>>>(-1);
     // hack? when importing a cl3, and we get a gbnl, put it into the
     // existing cl3
-    if (boost::iends_with(bin.native(), ".cl3") &&
-        dynamic_cast<Stcm::File*>(dmp.get()))
+    if (HasExt(bin, ".cl3", "") && dynamic_cast<Stcm::File*>(dmp.get()))
     {
-      auto cl3 = MakeSmart<Cl3>(Source::FromFile(bin));
+      auto cl3 = MakeSmart<Cl3>(MaybeDecompressZstd(Source::FromFile(bin)));
       auto stcme = cl3->entries.find("main.DAT", std::less<>{});
       if (stcme == cl3->entries.end())
         LIBSHIT_THROW(DecodeError, "Invalid CL3 file: no main.DAT");
@@ -235,7 +261,7 @@ static void DoAutoCl3(const boost::filesystem::path& p)
     boost::filesystem::path cl3_file =
       p.native().substr(0, p.native().size() - 4);
     INF << "Packing " << cl3_file << std::endl;
-    Cl3 cl3{Source::FromFile(cl3_file)};
+    Cl3 cl3{MaybeDecompressZstd(Source::FromFile(cl3_file))};
     cl3.UpdateFromDir(p);
     cl3.Fixup();
     cl3.Dump(cl3_file);
@@ -243,7 +269,7 @@ static void DoAutoCl3(const boost::filesystem::path& p)
   else
   {
     INF << "Extracting " << p << std::endl;
-    Cl3 cl3{Source::FromFile(p)};
+    Cl3 cl3{MaybeDecompressZstd(Source::FromFile(p))};
     auto out = p;
     cl3.ExtractTo(out += ".out");
   }
@@ -257,44 +283,21 @@ static inline bool is_file(const boost::filesystem::path& pth)
 }
 
 static bool IsBin(const boost::filesystem::path& p, bool = false)
-{
-  return is_file(p) && (
-    boost::iends_with(p.native(), ".cl3") ||
-    boost::iends_with(p.native(), ".gbin") ||
-    boost::iends_with(p.native(), ".gstr") ||
-    boost::iends_with(p.native(), ".bin"));
-}
+{ return is_file(p) && HasBinExt(p, ""); }
 
 static bool IsTxt(const boost::filesystem::path& p, bool = false)
-{
-  return is_file(p) && (
-    boost::iends_with(p.native(), ".cl3.txt") ||
-    boost::iends_with(p.native(), ".gbin.txt") ||
-    boost::iends_with(p.native(), ".gstr.txt") ||
-    boost::iends_with(p.native(), ".bin.txt"));
-}
+{ return is_file(p) && HasBinExt(p, ".txt"); }
 
 #if LIBSHIT_WITH_LUA
 static bool IsLua(const boost::filesystem::path& p, bool = false)
-{
-  return is_file(p) && (
-    boost::iends_with(p.native(), ".cl3.lua") ||
-    boost::iends_with(p.native(), ".gbin.lua") ||
-    boost::iends_with(p.native(), ".gstr.lua") ||
-    boost::iends_with(p.native(), ".bin.lua"));
-}
+{ return is_file(p) && HasBinExt(p, ".lua"); }
 #endif
 
 static bool IsCl3(const boost::filesystem::path& p, bool = false)
-{
-  return is_file(p) && boost::iends_with(p.native(), ".cl3");
-}
+{ return is_file(p) && HasExt(p, ".cl3", ""); }
 
 static bool IsCl3Dir(const boost::filesystem::path& p, bool = false)
-{
-  return boost::filesystem::is_directory(p) &&
-    boost::iends_with(p.native(), ".cl3.out");
-}
+{ return boost::filesystem::is_directory(p) && HasExt(p, ".cl3", ".out"); }
 
 static void DoAuto(const boost::filesystem::path& path)
 {
@@ -413,7 +416,6 @@ int main(int argc, char** argv)
     {
       mode = Mode::MANUAL;
       if (!st.dump) throw InvalidParam{"no file loaded"};
-      st.dump->Fixup();
       ShellDump(st.dump.get(), args.front());
     }};
   Option create_cl3_opt{
@@ -422,13 +424,21 @@ int main(int argc, char** argv)
     {
       mode = Mode::MANUAL;
       SmartPtr<Cl3> c = MakeSmart<Cl3>();
-      st = {c, c.get(), nullptr, nullptr};
+      st = {c, c.get(), nullptr, nullptr, nullptr};
     }};
   Option list_files_opt{
-    lgrp, "list-files", 0, nullptr, "Lists the contents of the cl3 archive",
+    lgrp, "list-files", 0, nullptr,
+    "Lists the contents of the cl3 or cpk archive",
     [&](auto&&)
     {
       mode = Mode::MANUAL;
+      if (st.cpk)
+      {
+        for (const auto& e : st.cpk->GetEntries())
+          std::cout << e.name << '\t' << e.extract_size << '\t' << e.size
+                    << std::endl;
+        return;
+      }
       if (!st.cl3) throw InvalidParam{"no cl3 loaded"};
       size_t i = 0;
       for (const auto& e : st.cl3->entries)
@@ -442,10 +452,18 @@ int main(int argc, char** argv)
     }};
   Option extract_file_opt{
     lgrp, "extract-file", 2, "NAME OUT_FILE|-",
-    "Extract NAME from cl3 archive to OUT_FILE or stdout",
+    "Extract NAME from cl3 or cpk archive to OUT_FILE or stdout",
     [&](auto&& args)
     {
       mode = Mode::MANUAL;
+      if (st.cpk)
+      {
+        auto e = st.cpk->FindEntry(args[0]);
+        if (!e) throw InvalidParam{"specified file not found"};
+        DumpableSource ds{st.cpk->GetSource(*e)};
+        ShellDump(&ds, args[1]);
+        return;
+      }
       if (!st.cl3) throw InvalidParam{"no cl3 loaded"};
       auto& entries = st.cl3->entries;
       auto e = entries.find(args[0]);
@@ -456,13 +474,25 @@ int main(int argc, char** argv)
         ShellDump(e->src.get(), args[1]);
     }};
   Option extract_files_opt{
-    lgrp, "extract-files", 1, "DIR", "Extract the cl3 archive to DIR",
+    lgrp, "extract-files", 1, "DIR", "Extract the cl3 or cpk archive to DIR",
     [&](auto&& args)
     {
       mode = Mode::MANUAL;
+      if (st.cpk) return st.cpk->ExtractTo(args.front());
       if (!st.cl3) throw InvalidParam{"no cl3 loaded"};
       st.cl3->ExtractTo(args.front());
     }};
+  Option open_entry_opt{
+    lgrp, "open-entry", 1, "NAME",
+    "Opens NAME from the loaded cpk archive as cl3 or stcm file",
+    [&](auto&& args)
+    {
+      mode = Mode::MANUAL;
+      if (!st.cpk) throw InvalidParam{"no cpk loaded"};
+      auto e = st.cpk->FindEntry(args.front());
+      if (!e) throw InvalidParam{"specified file not found"};
+      st = SmartOpen(st.cpk->GetSource(*e));
+    }};
   Option replace_file_opt{
     lgrp, "replace-file", 2, "NAME IN_FILE",
     "Adds or replaces NAME in cl3 archive with IN_FILE",
@@ -650,5 +680,7 @@ int main(int argc, char** argv)
           << std::endl;
       return 2;
     }
+    if (auto n = GetUnchangedDumpCount())
+      INF << "Skipped " << n << " unchanged file(s)" << std::endl;
     return auto_failed;
 }
@@ -33,6 +33,9 @@ namespace Libshit::Lua
     bld.AddFunction<
       static_cast<void (::Neptools::Sink::*)()>(&::Neptools::Sink::Flush)
     >("flush");
+    bld.AddFunction<
+      static_cast<void (::Neptools::Sink::*)()>(&::Neptools::Sink::Finish)
+    >("finish");
     bld.AddFunction<
       static_cast<void (::Neptools::Sink::*)(::boost::endian::little_uint8_t)>(&::Neptools::Sink::WriteLittleUint8<Check::Throw>)
     >("write_little_uint8");
@@ -59,6 +62,7 @@ namespace Libshit::Lua
     bld.Inherit<::Neptools::MemorySink, ::Neptools::Sink>();
 
     bld.AddFunction<
+      &::Libshit::Lua::TypeTraits<::Neptools::MemorySink>::Make<>,
       &::Libshit::Lua::TypeTraits<::Neptools::MemorySink>::Make<LuaGetRef<::Neptools::FileMemSize>>,
       static_cast<::Libshit::NotNull<Libshit::SmartPtr<::Neptools::MemorySink> > (*)(std::string_view)>(&Neptools::MemorySinkFromLua)
     >("new");
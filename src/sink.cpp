@@ -1,11 +1,39 @@
 #include "sink.hpp"
+#include "source.hpp"
 
 #include <libshit/except.hpp>
 #include <libshit/low_io.hpp>
 #include <libshit/lua/boost_endian_traits.hpp>
-
+#include <libshit/platform.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA
+#  include <sys/stat.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#  define NEPTOOLS_GATHER_SINK 1
+#else
+#  define NEPTOOLS_GATHER_SINK 0
+#endif
+
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <sys/sendfile.h>
+#  define NEPTOOLS_KERNEL_COPY 1
+#else
+#  define NEPTOOLS_KERNEL_COPY 0
+#endif
 
 #include <libshit/doctest.hpp>
 
@@ -23,6 +51,8 @@ namespace Neptools
       MmapSink(Libshit::LowIo&& io, FilePosition size);
       void Write_(std::string_view data) override;
       void Pad_(FileMemSize len) override;
+      Libshit::RefCountedPtr<Sink> SubSink(
+        FilePosition offs, FilePosition size) override;
 
       void MapNext(FileMemSize len);
 
@@ -32,23 +62,137 @@ namespace Neptools
 
     struct LIBSHIT_NOLUA SimpleSink final : public Sink
     {
-      SimpleSink(Libshit::LowIo io, FilePosition size)
-        : Sink{size}, io{Libshit::Move(io)}
+      // seekable: write with pwrite, skip over padding
+      SimpleSink(Libshit::LowIo io, FilePosition size, bool seekable)
+        : Sink{size}, io{Libshit::Move(io)}, seekable{seekable}
       {
         Sink::buf = buf;
         buf_size = MEM_CHUNK;
+        if (seekable && size != UNKNOWN_SIZE) this->io.Truncate(size);
       }
       ~SimpleSink() override;
 
       void Write_(std::string_view data) override;
       void Pad_(FileMemSize len) override;
       void Flush() override;
+      void Finish() override;
+
+      void Put(const void* ptr, FileMemSize len);
+
+      Libshit::LowIo io;
+      bool seekable;
+      Byte buf[MEM_CHUNK];
+    };
+
+#if NEPTOOLS_GATHER_SINK
+    // Writes with writev: normal writes are collected into blocks, WriteRef
+    // data is written from where it is, without copying.
+    struct LIBSHIT_NOLUA GatherSink final : public Sink
+    {
+      GatherSink(Libshit::LowIo io, FilePosition size, bool seekable);
+      ~GatherSink() override;
+
+      void Write_(std::string_view data) override;
+      void WriteRef_(std::string_view data) override;
+      void Pad_(FileMemSize len) override;
+      void Flush() override;
+      void Finish() override;
+#if NEPTOOLS_KERNEL_COPY
+      FilePosition CopyFrom_(
+        Libshit::LowIo& in, FilePosition offs, FilePosition len) override;
+#endif
+      Libshit::RefCountedPtr<Sink> SubSink(
+        FilePosition offs, FilePosition size) override;
+
+      void EndSegment();
+      void Push(const void* ptr, std::size_t len);
+      void NextBlock();
+      void WriteIovs();
+
+      static constexpr std::size_t BLOCK_SIZE = 64*1024;
+      static constexpr std::size_t MAX_IOVS = 1024; // IOV_MAX on linux
+      static constexpr std::size_t MAX_BUFFERED = 1024*1024;
+
+      Libshit::LowIo io;
+      bool seekable; // pad by seeking instead of writing zeros
+#if NEPTOOLS_KERNEL_COPY
+      // copy_file_range fails with EBADF on O_APPEND outputs (like >> in a
+      // shell)
+      bool append;
+#endif
+      std::vector<iovec> iovs;
+      // blocks[0..used_blocks) are referenced by iovs or are the current one
+      std::vector<std::unique_ptr<Byte[]>> blocks;
+      std::size_t used_blocks = 0, buffered = 0;
+    };
+#endif
+
+    // Writes from a background thread: a filled buffer is written while the
+    // next one is being filled.
+    struct LIBSHIT_NOLUA AsyncSink final : public Sink
+    {
+      AsyncSink(Libshit::LowIo io, FilePosition size, FileMemSize buffer_size);
+      ~AsyncSink() override;
+
+      void Write_(std::string_view data) override;
+      void Pad_(FileMemSize len) override;
+      void Flush() override;
+      void Finish() override;
+
+      void Submit();
+      void Run();
+
+      static constexpr std::size_t BUFFERS = 2;
 
       Libshit::LowIo io;
+      std::unique_ptr<Byte[]> bufs[BUFFERS];
+
+      std::mutex mutex;
+      std::condition_variable cv;
+      struct Pending { Byte* ptr; FileMemSize len; FilePosition offs; };
+      std::deque<Pending> queue; // waiting to be written
+      std::vector<Byte*> free_bufs;
+      std::exception_ptr error; // of the writer thread
+      bool stop = false;
+      std::thread thread;
+    };
+
+    // sub sink of a file: buffered pwrites into [base, base+size). The range
+    // is already zero (truncated file, padded by the parent), so padding only
+    // skips.
+    struct LIBSHIT_NOLUA PwriteSink final : public Sink
+    {
+      PwriteSink(Libshit::LowIo& io, FilePosition base, FilePosition size)
+        : Sink{size}, io{io}, base{base}
+      {
+        Sink::buf = buf;
+        buf_size = MEM_CHUNK;
+      }
+      ~PwriteSink() override;
+
+      void Write_(std::string_view data) override;
+      void Pad_(FileMemSize len) override;
+      void Flush() override;
+#if NEPTOOLS_KERNEL_COPY
+      FilePosition CopyFrom_(
+        Libshit::LowIo& in, FilePosition offs, FilePosition len) override;
+#endif
+      Libshit::RefCountedPtr<Sink> SubSink(
+        FilePosition offs, FilePosition size) override
+      {
+        LIBSHIT_ASSERT(offs + size <= this->size);
+        return Libshit::MakeRefCounted<PwriteSink>(io, base + offs, size);
+      }
+
+      Libshit::LowIo& io;
+      FilePosition base;
       Byte buf[MEM_CHUNK];
     };
   }
 
+  Libshit::RefCountedPtr<Sink> Sink::SubSink(FilePosition, FilePosition)
+  { return nullptr; }
+
   MmapSink::MmapSink(Libshit::LowIo&& io, FilePosition size) : Sink{size}
   {
     size_t to_map = size < MMAP_LIMIT ? size : MMAP_CHUNK;
@@ -58,6 +202,8 @@ namespace Neptools
     mm = io.Mmap(0, to_map, true);
     buf_size = to_map;
     buf = reinterpret_cast<Neptools::Byte*>(mm.Get());
+    // padding must not touch the pages, that'd allocate blocks for the holes
+    zero_buf = true;
 
     this->io = Libshit::Move(io);
   }
@@ -94,6 +240,123 @@ namespace Neptools
     MapNext(len % MMAP_CHUNK);
   }
 
+  AsyncSink::AsyncSink(
+    Libshit::LowIo io_in, FilePosition size, FileMemSize buffer_size)
+    : Sink{size}, io{Libshit::Move(io_in)}
+  {
+    if (size != UNKNOWN_SIZE) io.Truncate(size);
+    for (auto& b : bufs) b.reset(new Byte[buffer_size]);
+    for (std::size_t i = 1; i < BUFFERS; ++i)
+      free_bufs.push_back(bufs[i].get());
+    buf = bufs[0].get();
+    buf_size = buffer_size;
+    thread = std::thread{[this]() { Run(); }};
+  }
+
+  AsyncSink::~AsyncSink()
+  {
+    try { Finish(); }
+    catch (std::exception& e)
+    {
+      ERR << "~AsyncSink "
+          << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
+          << std::endl;
+    }
+
+    {
+      std::lock_guard lock{mutex};
+      stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+  }
+
+  void AsyncSink::Run()
+  {
+    std::unique_lock lock{mutex};
+    while (true)
+    {
+      cv.wait(lock, [&]() { return stop || !queue.empty(); });
+      if (queue.empty()) return;
+
+      auto [ptr, len, offs] = queue.front();
+      auto failed = !!error;
+      lock.unlock();
+      std::exception_ptr err;
+      // after an error only return the buffers, the output is broken anyway
+      if (!failed)
+        try { io.Pwrite(ptr, len, offs); }
+        catch (...) { err = std::current_exception(); }
+      lock.lock();
+
+      if (err) error = err;
+      queue.pop_front();
+      free_bufs.push_back(ptr);
+      cv.notify_all();
+    }
+  }
+
+  // queue the current buffer, continue with a free one
+  void AsyncSink::Submit()
+  {
+    if (!buf_put) return;
+    std::unique_lock lock{mutex};
+    if (error) std::rethrow_exception(error);
+    queue.push_back({buf, buf_put, offset});
+    offset += buf_put;
+    cv.notify_all();
+
+    cv.wait(lock, [&]() { return !free_bufs.empty(); });
+    buf = free_bufs.back();
+    free_bufs.pop_back();
+    buf_put = 0;
+  }
+
+  void AsyncSink::Flush()
+  {
+    Submit();
+    std::unique_lock lock{mutex};
+    cv.wait(lock, [&]() { return queue.empty(); });
+    if (error) std::rethrow_exception(error);
+  }
+
+  void AsyncSink::Finish()
+  {
+    Flush();
+    // a pad at the end only moved the offset
+    if (size == UNKNOWN_SIZE) io.Truncate(Tell());
+  }
+
+  void AsyncSink::Write_(std::string_view data)
+  {
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    while (!data.empty())
+    {
+      Submit();
+      auto cp = std::min<FileMemSize>(data.size(), buf_size);
+      memcpy(buf, data.data(), cp);
+      buf_put = cp;
+      data.remove_prefix(cp);
+    }
+  }
+
+  void AsyncSink::Pad_(FileMemSize len)
+  {
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    // the file is already truncated to the final size (or will be at the end),
+    // skipping leaves a hole
+    Submit();
+    offset += len;
+  }
+
+  Libshit::RefCountedPtr<Sink> MmapSink::SubSink(
+    FilePosition offs, FilePosition size)
+  {
+    LIBSHIT_ASSERT(offs + size <= this->size);
+    // not into the mapping: it's replaced when this sink moves on
+    return Libshit::MakeRefCounted<PwriteSink>(io, offs, size);
+  }
+
   void MmapSink::MapNext(FileMemSize len)
   {
     // wine fails on 0 size
@@ -117,7 +380,7 @@ namespace Neptools
 
   SimpleSink::~SimpleSink()
   {
-    try { Flush(); }
+    try { Finish(); }
     catch (std::exception& e)
     {
       ERR << "~SimpleSink "
@@ -126,26 +389,36 @@ namespace Neptools
     }
   }
 
+  void SimpleSink::Put(const void* ptr, FileMemSize len)
+  {
+    if (seekable) io.Pwrite(ptr, len, offset);
+    else io.Write(ptr, len);
+    offset += len;
+  }
+
   void SimpleSink::Flush()
   {
     if (buf_put)
     {
-      io.Write(buf, buf_put);
-      offset += buf_put;
+      Put(buf, buf_put);
       buf_put = 0;
     }
   }
 
+  void SimpleSink::Finish()
+  {
+    Flush();
+    if (seekable && size == UNKNOWN_SIZE) io.Truncate(Tell());
+  }
+
   void SimpleSink::Write_(std::string_view data)
   {
     LIBSHIT_ASSERT(buf_size == MEM_CHUNK && buf_put == MEM_CHUNK);
-    io.Write(buf, MEM_CHUNK);
-    offset += MEM_CHUNK;
+    Put(buf, MEM_CHUNK);
 
     if (data.length() >= MEM_CHUNK)
     {
-      io.Write(data.data(), data.length());
-      offset += data.length();
+      Put(data.data(), data.length());
       buf_put = 0;
     }
     else
@@ -158,11 +431,17 @@ namespace Neptools
   void SimpleSink::Pad_(FileMemSize len)
   {
     LIBSHIT_ASSERT(buf_size == MEM_CHUNK && buf_put == MEM_CHUNK);
-    io.Write(buf, MEM_CHUNK);
-    offset += MEM_CHUNK;
+    Put(buf, MEM_CHUNK);
+
+    if (seekable)
+    {
+      // truncated to the final size, skipping leaves a hole
+      offset += len / MEM_CHUNK * MEM_CHUNK;
+      memset(buf, 0, len % MEM_CHUNK);
+      buf_put = len % MEM_CHUNK;
+      return;
+    }
 
-    // assume we're not seekable (I don't care about not mmap-able but seekable
-    // files)
     if (len >= MEM_CHUNK)
     {
       memset(buf, 0, MEM_CHUNK);
@@ -176,32 +455,340 @@ namespace Neptools
     buf_put = len % MEM_CHUNK;
   }
 
+  PwriteSink::~PwriteSink()
+  {
+    try { Flush(); }
+    catch (std::exception& e)
+    {
+      ERR << "~PwriteSink "
+          << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
+          << std::endl;
+    }
+  }
+
+  void PwriteSink::Flush()
+  {
+    if (buf_put)
+    {
+      io.Pwrite(buf, buf_put, base + offset);
+      offset += buf_put;
+      buf_put = 0;
+    }
+  }
+
+  void PwriteSink::Write_(std::string_view data)
+  {
+    LIBSHIT_ASSERT(buf_size == MEM_CHUNK && buf_put == MEM_CHUNK);
+    Flush();
+
+    if (data.length() >= MEM_CHUNK)
+    {
+      io.Pwrite(data.data(), data.length(), base + offset);
+      offset += data.length();
+    }
+    else
+    {
+      memcpy(buf, data.data(), data.length());
+      buf_put = data.length();
+    }
+  }
+
+  void PwriteSink::Pad_(FileMemSize len)
+  {
+    LIBSHIT_ASSERT(buf_size == MEM_CHUNK && buf_put == MEM_CHUNK);
+    Flush();
+    offset += len / MEM_CHUNK * MEM_CHUNK;
+    memset(buf, 0, len % MEM_CHUNK);
+    buf_put = len % MEM_CHUNK;
+  }
+
+#if NEPTOOLS_KERNEL_COPY
+  // below this writing the data normally is cheaper than breaking up writes
+  static constexpr FilePosition KERNEL_COPY_LIMIT = 64*1024;
+
+  static bool CopyUnsupported(int err) noexcept
+  {
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP ||
+      err == EINVAL;
+  }
+
+  // Copy [offs, offs+len) of in to out at *out_offs, or at out's file position
+  // if out_offs is nullptr. Returns the number of bytes copied, which is less
+  // than len if the kernel can't copy between these files.
+  static FilePosition KernelCopy(
+    int in, FilePosition offs, int out, loff_t* out_offs, FilePosition len)
+  {
+    loff_t in_offs = offs;
+    FilePosition done = 0;
+    // only when writing at the file position: sendfile has no output offset
+    bool use_sendfile = false;
+    while (done < len)
+    {
+      ssize_t res;
+      if (use_sendfile)
+      {
+        off_t o = in_offs;
+        res = sendfile(out, in, &o, len - done);
+        if (res > 0) in_offs += res;
+      }
+      else
+        res = copy_file_range(in, &in_offs, out, out_offs, len - done, 0);
+
+      if (res < 0)
+      {
+        if (errno == EINTR) continue;
+        if (!CopyUnsupported(errno))
+          LIBSHIT_THROW_ERRNO(use_sendfile ? "sendfile" : "copy_file_range");
+        // older kernels can't copy_file_range between file systems
+        if (use_sendfile || out_offs) return done;
+        use_sendfile = true;
+        continue;
+      }
+      if (res == 0) break; // file shrank? let the caller read it
+      done += res;
+    }
+    return done;
+  }
+
+  FilePosition PwriteSink::CopyFrom_(
+    Libshit::LowIo& in, FilePosition offs, FilePosition len)
+  {
+    if (len < KERNEL_COPY_LIMIT) return 0;
+    Flush();
+    loff_t out_offs = base + offset;
+    auto res = KernelCopy(in.fd, offs, io.fd, &out_offs, len);
+    offset += res;
+    return res;
+  }
+#endif
+
+#if NEPTOOLS_GATHER_SINK
+  GatherSink::GatherSink(Libshit::LowIo io_in, FilePosition size, bool seekable)
+    : Sink{size}, io{Libshit::Move(io_in)}, seekable{seekable}
+  {
+    if (seekable && size != UNKNOWN_SIZE) io.Truncate(size);
+#if NEPTOOLS_KERNEL_COPY
+    auto flags = fcntl(io.fd, F_GETFL);
+    append = flags != -1 && (flags & O_APPEND);
+#endif
+    iovs.reserve(MAX_IOVS);
+    NextBlock();
+  }
+
+  GatherSink::~GatherSink()
+  {
+    try { Finish(); }
+    catch (std::exception& e)
+    {
+      ERR << "~GatherSink "
+          << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
+          << std::endl;
+    }
+  }
+
+  // move the bytes written into the current block into an iovec
+  void GatherSink::EndSegment()
+  {
+    if (!buf_put) return;
+    Push(buf, buf_put);
+    buffered += buf_put;
+    offset += buf_put;
+    buf += buf_put;
+    buf_size -= buf_put;
+    buf_put = 0;
+  }
+
+  void GatherSink::Push(const void* ptr, std::size_t len)
+  {
+    if (!iovs.empty() && static_cast<Byte*>(iovs.back().iov_base) +
+        iovs.back().iov_len == ptr)
+    {
+      iovs.back().iov_len += len;
+      return;
+    }
+    if (iovs.size() == MAX_IOVS) WriteIovs();
+    iovs.push_back({const_cast<void*>(ptr), len});
+  }
+
+  void GatherSink::NextBlock()
+  {
+    EndSegment();
+    if (buffered >= MAX_BUFFERED) WriteIovs();
+    if (used_blocks == blocks.size())
+      blocks.emplace_back(new Byte[BLOCK_SIZE]);
+    buf = blocks[used_blocks++].get();
+    buf_size = BLOCK_SIZE;
+  }
+
+  void GatherSink::WriteIovs()
+  {
+    auto iov = iovs.data(), end = iovs.data() + iovs.size();
+    while (iov != end)
+    {
+      auto res = writev(io.fd, iov, end - iov);
+      if (res < 0)
+      {
+        if (errno == EINTR) continue;
+        LIBSHIT_THROW_ERRNO("writev");
+      }
+      for (std::size_t n = res; n; )
+        if (n >= iov->iov_len) n -= iov++->iov_len;
+        else
+        {
+          iov->iov_base = static_cast<Byte*>(iov->iov_base) + n;
+          iov->iov_len -= n;
+          n = 0;
+        }
+    }
+    iovs.clear();
+    buffered = 0;
+
+    // everything written, only the current block's free space is used
+    if (used_blocks)
+    {
+      std::swap(blocks[0], blocks[used_blocks-1]);
+      used_blocks = 1;
+    }
+  }
+
+  void GatherSink::Flush()
+  {
+    EndSegment();
+    WriteIovs();
+  }
+
+  void GatherSink::Finish()
+  {
+    Flush();
+    // a pad at the end only moved the file position
+    if (seekable && size == UNKNOWN_SIZE) io.Truncate(Tell());
+  }
+
+  void GatherSink::Write_(std::string_view data)
+  {
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    while (!data.empty())
+    {
+      NextBlock();
+      auto cp = std::min<std::size_t>(data.size(), buf_size);
+      memcpy(buf, data.data(), cp);
+      buf_put = cp;
+      data.remove_prefix(cp);
+    }
+  }
+
+  void GatherSink::WriteRef_(std::string_view data)
+  {
+    EndSegment();
+    Push(data.data(), data.size());
+    offset += data.size();
+  }
+
+  void GatherSink::Pad_(FileMemSize len)
+  {
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    if (seekable)
+    {
+      // the file is already truncated to the final size, it's zero there (or
+      // it'll be extended at the end)
+      Flush();
+      if (lseek(io.fd, len, SEEK_CUR) == -1) LIBSHIT_THROW_ERRNO("lseek");
+      offset += len;
+      return;
+    }
+
+    static const Byte zeros[MEM_CHUNK] = {};
+    EndSegment();
+    while (len)
+    {
+      auto n = std::min<FileMemSize>(len, MEM_CHUNK);
+      Push(zeros, n);
+      offset += n;
+      len -= n;
+    }
+  }
+
+#if NEPTOOLS_KERNEL_COPY
+  FilePosition GatherSink::CopyFrom_(
+    Libshit::LowIo& in, FilePosition offs, FilePosition len)
+  {
+    if (append || len < KERNEL_COPY_LIMIT) return 0;
+    Flush();
+    auto res = KernelCopy(in.fd, offs, io.fd, nullptr, len);
+    offset += res;
+    return res;
+  }
+#endif
+
+  Libshit::RefCountedPtr<Sink> GatherSink::SubSink(
+    FilePosition offs, FilePosition size)
+  {
+    if (!seekable) return nullptr;
+    LIBSHIT_ASSERT(offs + size <= this->size);
+    return Libshit::MakeRefCounted<PwriteSink>(io, offs, size);
+  }
+#endif
+
+  static Libshit::NotNull<Libshit::RefCountedPtr<Sink>> ToLowIo(
+    Libshit::LowIo io, FilePosition size, bool try_mmap)
+  {
+    auto& settings = GetIoSettings();
+    if (settings.write_behind)
+      return Libshit::MakeRefCounted<AsyncSink>(
+        Libshit::Move(io), size, settings.write_buffer_size);
+
+    auto simple = [&]() -> Libshit::NotNull<Libshit::RefCountedPtr<Sink>>
+    {
+#if NEPTOOLS_GATHER_SINK
+      return Libshit::MakeRefCounted<GatherSink>(Libshit::Move(io), size, true);
+#else
+      return Libshit::MakeRefCounted<SimpleSink>(Libshit::Move(io), size, true);
+#endif
+    };
+    if (LIBSHIT_OS_IS_VITA || !try_mmap || size == Sink::UNKNOWN_SIZE)
+      return simple();
+
+    try { return Libshit::MakeRefCounted<MmapSink>(Libshit::Move(io), size); }
+    catch (const Libshit::SystemError& e)
+    {
+      WARN << "Mmmap failed, falling back to normal writing: "
+           << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
+           << std::endl;
+      return simple();
+    }
+  }
+
   Libshit::NotNull<Libshit::RefCountedPtr<Sink>> Sink::ToFile(
     boost::filesystem::path fname, FilePosition size, bool try_mmap)
   {
     return Libshit::AddInfo(
-      [&]() -> Libshit::NotNull<Libshit::RefCountedPtr<Sink>>
+      [&]()
       {
         Libshit::LowIo io{fname.c_str(), Libshit::LowIo::Permission::READ_WRITE,
           Libshit::LowIo::Mode::TRUNC_OR_CREATE};
-        if (LIBSHIT_OS_IS_VITA || !try_mmap)
-          return Libshit::MakeRefCounted<SimpleSink>(Libshit::Move(io), size);
-
-        try { return Libshit::MakeRefCounted<MmapSink>(Libshit::Move(io), size); }
-        catch (const Libshit::SystemError& e)
-        {
-          WARN << "Mmmap failed, falling back to normal writing: "
-               << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
-               << std::endl;
-          return Libshit::MakeRefCounted<SimpleSink>(Libshit::Move(io), size);
-        }
+        return ToLowIo(Libshit::Move(io), size, try_mmap);
       },
       [&](auto& e) { Libshit::AddInfos(e, "File name", fname.string()); });
   }
 
+  Libshit::NotNull<Libshit::RefCountedPtr<Sink>> Sink::ToFd(
+    boost::filesystem::path fname, Libshit::LowIo::FdType fd, bool owning,
+    FilePosition size, bool try_mmap)
+  {
+    return Libshit::AddInfo(
+      [&]() { return ToLowIo(Libshit::LowIo{fd, owning}, size, try_mmap); },
+      [&](auto& e) { Libshit::AddInfos(e, "File name", fname.string()); });
+  }
+
   Libshit::NotNull<Libshit::RefCountedPtr<Sink>> Sink::ToStdOut()
   {
-    return Libshit::MakeRefCounted<SimpleSink>(Libshit::LowIo::OpenStdOut(), -1);
+#if NEPTOOLS_GATHER_SINK
+    return Libshit::MakeRefCounted<GatherSink>(
+      Libshit::LowIo::OpenStdOut(), -1, false);
+#else
+    return Libshit::MakeRefCounted<SimpleSink>(
+      Libshit::LowIo::OpenStdOut(), -1, false);
+#endif
   }
 
 #define TRY_MMAP                           \
@@ -416,10 +1003,272 @@ namespace Neptools
   }
 
 
-  void MemorySink::Write_(std::string_view)
-  { LIBSHIT_UNREACHABLE("MemorySink::Write_ called"); }
-  void MemorySink::Pad_(FileMemSize)
-  { LIBSHIT_UNREACHABLE("MemorySink::Pad_ called"); }
+  void MemorySink::Grow(FileMemSize len)
+  {
+    if (!growable) LIBSHIT_UNREACHABLE("MemorySink overflow");
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    auto nsize = std::max(2*buf_size, buf_size + len);
+    std::unique_ptr<Byte[]> nbuf{new Byte[nsize]};
+    memcpy(nbuf.get(), buf, buf_put);
+    uniq_buf = Libshit::Move(nbuf);
+    buf = uniq_buf.get();
+    buf_size = nsize;
+  }
+
+  void MemorySink::Write_(std::string_view data)
+  {
+    Grow(data.size());
+    memcpy(buf + buf_put, data.data(), data.size());
+    buf_put += data.size();
+  }
+  void MemorySink::Pad_(FileMemSize len)
+  {
+    Grow(len);
+    memset(buf + buf_put, 0, len);
+    buf_put += len;
+  }
+
+  Libshit::RefCountedPtr<Sink> MemorySink::SubSink(
+    FilePosition offs, FilePosition size)
+  {
+    if (growable) return nullptr; // buf moves when growing
+    LIBSHIT_ASSERT(offs + size <= this->size);
+    return Libshit::MakeRefCounted<MemorySink>(buf + offs, size);
+  }
+
+  TEST_CASE("sub sinks")
+  {
+    TRY_MMAP;
+    static constexpr FilePosition SIZE = 3*MEM_CHUNK;
+    std::string exp(SIZE, '\0');
+    for (size_t i = 0; i < 2*MEM_CHUNK; ++i) exp[i] = char(i % 251);
+    std::string_view first{exp.data(), MEM_CHUNK + 10};
+    std::string_view second{exp.data() + first.size(), MEM_CHUNK - 10};
+
+    auto check = [&](auto& sink)
+    {
+      sink.WriteGen(exp[0]);
+      auto a = sink.SubSink(1, first.size() - 1);
+      auto b = sink.SubSink(first.size(), SIZE - first.size());
+      REQUIRE(a); REQUIRE(b);
+      sink.Pad(SIZE - 1);
+      sink.Flush();
+      b->Write(second);
+      b->Pad(MEM_CHUNK);
+      CHECK(b->Tell() == SIZE - first.size());
+      a->Write(first.substr(1));
+      a->Flush(); b->Flush();
+    };
+
+    {
+      auto sink = Sink::ToFile("tmp", SIZE, try_mmap);
+      // normal writes are not seekable everywhere
+      if (!sink->SubSink(0, 0)) { CHECK(!try_mmap); return; }
+      check(*sink);
+      CHECK(sink->Tell() == SIZE);
+    }
+    std::string act(SIZE, '\0');
+    std::ifstream is{"tmp", std::ios_base::binary};
+    is.read(act.data(), SIZE);
+    REQUIRE(is.good());
+    CHECK(act == exp);
+
+    MemorySink mem{SIZE};
+    check(mem);
+    CHECK(mem.GetStringView() == exp);
+  }
+
+  TEST_CASE("unknown size")
+  {
+    TRY_MMAP;
+    std::string data(MEM_CHUNK + 3, 'x');
+    {
+      auto sink = Sink::ToFile("tmp", Sink::UNKNOWN_SIZE, try_mmap);
+      sink->Write(data);
+      sink->Pad(2*MEM_CHUNK);
+      sink->Write(data);
+      sink->Pad(5); // file must be extended
+    }
+
+    auto exp = data + std::string(2*MEM_CHUNK, '\0') + data + std::string(5, '\0');
+    std::string act(exp.size(), '\1');
+    std::ifstream is{"tmp", std::ios_base::binary};
+    is.read(act.data(), exp.size());
+    REQUIRE(is.good());
+    CHECK(act == exp);
+    is.get();
+    CHECK(is.eof());
+  }
+
+  TEST_CASE("finish")
+  {
+    auto sink = Sink::ToFile("tmp", Sink::UNKNOWN_SIZE);
+    sink->Write("abc");
+    sink->Pad(5);
+    sink->Finish();
+    // complete before the sink is destroyed
+    std::ifstream is{"tmp", std::ios_base::binary | std::ios_base::ate};
+    CHECK(FilePosition(is.tellg()) == 8);
+    sink->Finish();
+  }
+
+#if NEPTOOLS_GATHER_SINK
+  TEST_CASE("sparse pad")
+  {
+    IoSettingsGuard guard;
+    auto& settings = GetIoSettings();
+    bool try_mmap = true;
+    SUBCASE("mmap") {}
+    SUBCASE("writev") { try_mmap = false; }
+    SUBCASE("write behind") { settings.write_behind = true; }
+
+    static constexpr FilePosition SIZE = 64*1024*1024;
+    {
+      auto sink = Sink::ToFile("tmp", SIZE, try_mmap);
+      sink->WriteLittleUint32(0x12345678);
+      sink->Pad(SIZE - 8);
+      sink->WriteLittleUint32(0x9abcdef0);
+    }
+
+    struct stat st;
+    REQUIRE(stat("tmp", &st) == 0);
+    CHECK(FilePosition(st.st_size) == SIZE);
+    // only the blocks around the two writes are allocated
+    CHECK(FilePosition(st.st_blocks) * 512 < 1024*1024);
+
+    std::ifstream is{"tmp", std::ios_base::binary};
+    boost::endian::little_uint32_t x;
+    is.read(reinterpret_cast<char*>(&x), 4);
+    CHECK(x == 0x12345678);
+    is.seekg(SIZE / 2);
+    CHECK(is.get() == 0);
+    is.seekg(SIZE - 4);
+    is.read(reinterpret_cast<char*>(&x), 4);
+    CHECK(x == 0x9abcdef0);
+    REQUIRE(is.good());
+  }
+#endif
+
+  TEST_CASE("write behind")
+  {
+    IoSettingsGuard guard;
+    auto& settings = GetIoSettings();
+    settings.write_behind = true;
+    settings.write_buffer_size = 1000; // not a divisor of anything below
+
+    std::string exp;
+    {
+      auto sink = Sink::ToFile("tmp", Sink::UNKNOWN_SIZE);
+      for (int i = 0; i < 3000; ++i)
+      {
+        sink->WriteLittleUint32(i);
+        std::uint32_t le = boost::endian::native_to_little(std::uint32_t(i));
+        exp.append(reinterpret_cast<char*>(&le), 4);
+        if (i % 1000 == 0)
+        {
+          std::string big(2500 + i, 'a' + i % 26);
+          sink->Write(big);
+          sink->Pad(1500);
+          exp += big + std::string(1500, '\0');
+        }
+      }
+      sink->Flush();
+      CHECK(sink->Tell() == exp.size());
+    }
+
+    std::string act(exp.size(), '\0');
+    std::ifstream is{"tmp", std::ios_base::binary};
+    is.read(act.data(), exp.size());
+    REQUIRE(is.good());
+    CHECK(act == exp);
+    is.get();
+    CHECK(is.eof());
+  }
+
+#ifdef __linux__
+  TEST_CASE("write behind error")
+  {
+    IoSettingsGuard guard;
+    GetIoSettings().write_behind = true;
+
+    // writes fail with ENOSPC, the error of the writer thread is reported by
+    // Finish, not only logged by the destructor
+    auto sink = Sink::ToFile("/dev/full", Sink::UNKNOWN_SIZE);
+    sink->Write("x");
+    CHECK_THROWS(sink->Finish());
+  }
+#endif
+
+  // only measures, run it with --no-skip
+  TEST_CASE("sink throughput" * doctest::skip())
+  {
+    // "many small writes" pattern
+    static constexpr FilePosition SIZE = 16*1024*1024 / 24 * 24;
+    auto run = [](const char* name, auto make)
+    {
+      int buf[6] = {0,77,-123,98,77,-1};
+      auto start = std::chrono::steady_clock::now();
+      {
+        Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_WRITE,
+          Libshit::LowIo::Mode::TRUNC_OR_CREATE};
+        auto sink = make(Libshit::Move(io));
+        for (FilePosition i = 0; i < SIZE; i += 24)
+        {
+          buf[0] = static_cast<int>(i / 24);
+          sink->WriteGen(buf);
+        }
+      }
+      std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+      MESSAGE(name << ": " << SIZE / time.count() / (1024*1024) << " MiB/s");
+
+      std::ifstream is{"tmp", std::ios_base::binary | std::ios_base::ate};
+      CHECK(FilePosition(is.tellg()) == SIZE);
+    };
+
+    using Libshit::MakeRefCounted;
+    using Libshit::Move;
+    run("simple", [](Libshit::LowIo io)
+    { return MakeRefCounted<SimpleSink>(Move(io), SIZE, false); });
+    run("mmap", [](Libshit::LowIo io)
+    { return MakeRefCounted<MmapSink>(Move(io), SIZE); });
+#if NEPTOOLS_GATHER_SINK
+    run("writev", [](Libshit::LowIo io)
+    { return MakeRefCounted<GatherSink>(Move(io), SIZE, true); });
+#endif
+    for (FileMemSize bs : {64*1024, 1024*1024})
+      run(bs == 64*1024 ? "write behind 64K" : "write behind 1M",
+          [bs](Libshit::LowIo io)
+          {
+            return Libshit::MakeRefCounted<AsyncSink>(
+              Libshit::Move(io), SIZE, bs);
+          });
+  }
+
+  TEST_CASE("write ref")
+  {
+    TRY_MMAP;
+    static constexpr FilePosition SIZE = 3*MEM_CHUNK + 100;
+    std::string data(2*MEM_CHUNK, 'x');
+    std::string exp = "head" + data + std::string(MEM_CHUNK, '\0') + "tail";
+    exp.resize(SIZE, 'y');
+    {
+      auto sink = Sink::ToFile("tmp", SIZE, try_mmap);
+      sink->Write("head");
+      sink->WriteRef(data);
+      sink->Pad(MEM_CHUNK);
+      sink->Write("tail");
+      sink->WriteRef(std::string_view{exp}.substr(sink->Tell()));
+      CHECK(sink->Tell() == SIZE);
+      sink->Flush();
+    }
+
+    std::string act(SIZE, '\0');
+    std::ifstream is{"tmp", std::ios_base::binary};
+    is.read(act.data(), SIZE);
+    REQUIRE(is.good());
+    CHECK(act == exp);
+  }
 
   TEST_CASE("memory one write")
   {
@@ -471,6 +1320,26 @@ namespace Neptools
     REQUIRE(memcmp(buf_out, buf_exp, 32) == 0);
   }
 
+  TEST_CASE("memory growable")
+  {
+    MemorySink sink;
+    std::string exp;
+    for (int i = 0; i < 1000; ++i)
+    {
+      sink.WriteLittleUint32(i);
+      sink.Pad(i % 7);
+      std::uint32_t le = boost::endian::native_to_little(std::uint32_t(i));
+      exp.append(reinterpret_cast<char*>(&le), 4);
+      exp.append(i % 7, '\0');
+    }
+    std::string big(3*MEM_CHUNK, 'x');
+    sink.Write(big);
+    exp += big;
+    CHECK(sink.Tell() == exp.size());
+    CHECK(sink.GetStringView() == exp);
+    CHECK(!sink.SubSink(0, 1));
+  }
+
   TEST_CASE("memory alloc by itself")
   {
     char buf_exp[4] = { 0x78, 0x56, 0x34, 0x12 };
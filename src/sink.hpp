@@ -5,6 +5,7 @@
 #include "utils.hpp"
 
 #include <libshit/check.hpp>
+#include <libshit/low_io.hpp>
 #include <libshit/meta.hpp>
 #include <libshit/meta_utils.hpp>
 #include <libshit/shared_ptr.hpp>
@@ -25,8 +26,18 @@ namespace Neptools
   {
     LIBSHIT_DYNAMIC_OBJECT;
   public:
+    /// Size of sinks that grow as they're written (use Dumpable::DumpStream
+    /// to dump into them without computing the size first).
+    static constexpr FilePosition UNKNOWN_SIZE = -1;
+
+    /// size can be UNKNOWN_SIZE, the file is not mapped then.
     static Libshit::NotNull<Libshit::RefCountedPtr<Sink>> ToFile(
       boost::filesystem::path fname, FilePosition size, bool try_mmap = true);
+    /// Write into an already open, empty file (fname is only used in error
+    /// messages).
+    LIBSHIT_NOLUA static Libshit::NotNull<Libshit::RefCountedPtr<Sink>> ToFd(
+      boost::filesystem::path fname, Libshit::LowIo::FdType fd, bool owning,
+      FilePosition size, bool try_mmap = true);
     static Libshit::NotNull<Libshit::RefCountedPtr<Sink>> ToStdOut();
 
     FilePosition Tell() const noexcept { return offset + buf_put; }
@@ -48,13 +59,37 @@ namespace Neptools
       if (!data.empty()) Write_(data);
     }
 
+    /// Write data that stays valid and unchanged until the next Flush (like
+    /// chunks of sources with stable chunks). Sinks may write it out from
+    /// there later instead of copying it.
+    template <typename Checker = Libshit::Check::Assert>
+    LIBSHIT_NOLUA void WriteRef(std::string_view data)
+    {
+      LIBSHIT_CHECK(SinkOverflow, offset+buf_put+data.length() <= size,
+                    "Sink overflow during write");
+      if (data.length() < MEM_CHUNK) Write<Checker>(data);
+      else WriteRef_(data);
+    }
+
+    /// Copy [offs, offs+len) of a file to the output without reading it into
+    /// memory (copy_file_range, sendfile), if the sink supports it. Returns
+    /// the number of bytes copied, the rest must be written normally.
+    template <typename Checker = Libshit::Check::Assert>
+    LIBSHIT_NOLUA FilePosition CopyFrom(
+      Libshit::LowIo& io, FilePosition offs, FilePosition len)
+    {
+      LIBSHIT_CHECK(SinkOverflow, offset+buf_put+len <= size,
+                    "Sink overflow during copy");
+      return CopyFrom_(io, offs, len);
+    }
+
     template <typename Checker = Libshit::Check::Assert>
     void Pad(FileMemSize len)
     {
       LIBSHIT_CHECK(SinkOverflow, offset+buf_put+len <= size,
                     "Sink overflow during pad");
       auto cp = std::min(len, buf_size - buf_put);
-      memset(buf+buf_put, 0, cp);
+      if (!zero_buf) memset(buf+buf_put, 0, cp);
       buf_put += cp;
       len -= cp;
 
@@ -62,6 +97,19 @@ namespace Neptools
     }
 
     virtual void Flush() {}
+    /// Flush and complete the output (like setting the final size of an
+    /// UNKNOWN_SIZE file), nothing can be written after it. The destructor
+    /// does it too, but it can only log errors. Calling it again does
+    /// nothing.
+    virtual void Finish() { Flush(); }
+
+    /// Independent sink writing [offs, offs+size) of the same output, so
+    /// parts can be written from multiple threads. Writes through this sink
+    /// to the range are not ordered with the sub sink's, skip it with Pad and
+    /// Flush before using the sub sink. Must not outlive this sink. Returns
+    /// nullptr if the output is not seekable.
+    LIBSHIT_NOLUA virtual Libshit::RefCountedPtr<Sink> SubSink(
+      FilePosition offs, FilePosition size);
 
 #define NEPTOOLS_GEN(bits)                                               \
     template <typename Checker = Libshit::Check::Assert>                 \
@@ -80,10 +128,16 @@ namespace Neptools
     Byte* buf = nullptr;
     FilePosition offset = 0, size;
     FileMemSize buf_put = 0, buf_size;
+    /// buf after buf_put is already zero (mapped from a new file), Pad doesn't
+    /// have to touch it.
+    bool zero_buf = false;
 
   private:
     virtual void Write_(std::string_view data) = 0;
     virtual void Pad_(FileMemSize len) = 0;
+    virtual void WriteRef_(std::string_view data) { Write(data); }
+    virtual FilePosition CopyFrom_(Libshit::LowIo&, FilePosition, FilePosition)
+    { return 0; }
   } LIBSHIT_LUAGEN(post_register=[[
     // hack to get close call __gc
     lua_getfield(bld, -2, "__gc");
@@ -107,16 +161,27 @@ namespace Neptools
     MemorySink(FileMemSize size) : Sink{size}, uniq_buf{new Byte[size]}
     { buf = uniq_buf.get(); buf_size = size; }
 
+    /// Growing sink (size is UNKNOWN_SIZE).
+    MemorySink()
+      : Sink{UNKNOWN_SIZE}, uniq_buf{new Byte[MEM_CHUNK]}, growable{true}
+    { buf = uniq_buf.get(); buf_size = MEM_CHUNK; }
+
+    /// Everything written so far (the whole buffer if not growable)
     LIBSHIT_LUAGEN(name="to_string")
     std::string_view GetStringView() const noexcept
-    { return {reinterpret_cast<const char*>(buf), buf_size}; }
+    { return {reinterpret_cast<const char*>(buf), growable ? buf_put : buf_size}; }
 
     LIBSHIT_NOLUA
     std::unique_ptr<Byte[]> Release() noexcept { return std::move(uniq_buf); }
 
+    LIBSHIT_NOLUA Libshit::RefCountedPtr<Sink> SubSink(
+      FilePosition offs, FilePosition size) override;
+
   private:
     std::unique_ptr<Byte[]> uniq_buf;
+    bool growable = false;
 
+    void Grow(FileMemSize len);
     void Write_(std::string_view) override;
     void Pad_(FileMemSize) override;
   };
@@ -28,6 +28,12 @@ namespace Libshit::Lua
     bld.AddFunction<
       static_cast<void (::Neptools::Source::*)(::Neptools::FilePosition, ::Neptools::FilePosition) noexcept>(&::Neptools::Source::Slice<Check::Throw>)
     >("slice");
+    bld.AddFunction<
+      static_cast<::Neptools::Source (::Neptools::Source::*)(::Neptools::FilePosition, std::string) const>(&::Neptools::Source::Replace)
+    >("replace");
+    bld.AddFunction<
+      static_cast<::Neptools::Source (::Neptools::Source::*)(::Neptools::FilePosition, std::string) const>(&::Neptools::Source::Insert)
+    >("insert");
     bld.AddFunction<
       static_cast<::Neptools::FilePosition (::Neptools::Source::*)() const noexcept>(&::Neptools::Source::GetOffset)
     >("get_offset");
@@ -148,6 +154,13 @@ namespace Libshit::Lua
     bld.AddFunction<
       static_cast<::Libshit::Lua::RetNum (*)(::Libshit::Lua::StateRef, ::Neptools::Source &, ::Neptools::FilePosition, ::Neptools::FileMemSize)>(&Neptools::LuaPread)
     >("pread");
+    bld.AddFunction<
+      static_cast<::Libshit::Lua::RetNum (*)(::Libshit::Lua::StateRef, const ::Neptools::Source &)>(&Neptools::LuaGetIoStats),
+      static_cast<::Libshit::Lua::RetNum (*)(::Libshit::Lua::StateRef)>(&Neptools::LuaGetIoStats)
+    >("get_io_stats");
+    bld.AddFunction<
+      static_cast<::Neptools::Source (*)(::Libshit::Lua::StateRef, ::Libshit::Lua::RawTable)>(&Neptools::LuaConcat)
+    >("concat");
 
   }
   static TypeRegister::StateRegister<::Neptools::Source> reg_neptools_source;
@@ -1,17 +1,34 @@
 #include "source.hpp"
+#include "binary_reader.hpp"
 #include "sink.hpp"
 
 #include <libshit/char_utils.hpp>
 #include <libshit/except.hpp>
 #include <libshit/lua/function_call.hpp>
+#include <libshit/options.hpp>
 #include <libshit/platform.hpp>
 
+#include <boost/intrusive/list.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <random>
+#include <thread>
+#include <vector>
 
 #if !LIBSHIT_OS_IS_WINDOWS
 #  include <unistd.h>
 #endif
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#endif
 
 #include <libshit/doctest.hpp>
 
@@ -32,24 +49,44 @@ namespace Neptools
                FilePosition size)
         : Source::Provider{Libshit::Move(file_name), size},
           io{Libshit::Move(io)} {}
+      void InitLru(const IoSettings& settings)
+      { lru = Lru{settings.cache_slots, static_cast<T*>(this)->CHUNK_SIZE}; }
 
       void Destroy() noexcept;
 
       void Pread(FilePosition offs, Byte* buf, FileMemSize len) override;
-      void EnsureChunk(FilePosition i);
+      Libshit::LowIo* GetLowIo() noexcept override { return &io; }
+      void FreeChunk(const Source::BufEntry& e) noexcept override
+      { static_cast<T*>(this)->DeleteChunk(e); }
+      const Source::BufEntry& EnsureChunk(FilePosition i);
+      void FAdvise(FilePosition offs, FilePosition len) noexcept;
 
       Libshit::LowIo io;
+
+      // sequential access detection, only looks at LRU misses
+      static constexpr unsigned SEQ_THRESHOLD = 2;
+      FilePosition seq_next = -1;
+      unsigned seq_count = 0;
     };
 
     struct MmapProvider final : public UnixLike<MmapProvider>
     {
       MmapProvider(Libshit::LowIo&& fd, boost::filesystem::path file_name,
-                   FilePosition size);
+                   FilePosition size,
+                   const IoSettings& settings = GetIoSettings());
       ~MmapProvider() noexcept override { Destroy(); }
 
-      static FileMemSize CHUNK_SIZE;
+      void SetAccessPattern(AccessPattern pat) override;
+      void Prefetch(FilePosition offs, FilePosition len) noexcept override;
+      bool HasStableChunks() const noexcept override { return whole; }
+
+      FileMemSize CHUNK_SIZE;
       void* ReadChunk(FilePosition offs, FileMemSize size);
-      void DeleteChunk(size_t i);
+      void DeleteChunk(const Source::BufEntry& e) noexcept;
+      void Advise(const Byte* ptr, FileMemSize size) noexcept;
+
+      AccessPattern access;
+      bool whole = false; // mapped as a whole, no windows
     };
 
     struct UnixProvider final : public UnixLike<UnixProvider>
@@ -57,13 +94,30 @@ namespace Neptools
       //using UnixLike::UnixLike;
       // workaround clang bug...
       UnixProvider(Libshit::LowIo&& io, boost::filesystem::path file_name,
-                   FilePosition size)
-        : UnixLike{Libshit::Move(io), Libshit::Move(file_name), size} {}
+                   FilePosition size,
+                   const IoSettings& settings = GetIoSettings())
+        : UnixLike{Libshit::Move(io), Libshit::Move(file_name), size},
+          CHUNK_SIZE{settings.read_chunk_size}
+      {
+        InitLru(settings);
+        pool.reserve(POOL_SIZE); // DeleteChunk can't throw
+      }
       ~UnixProvider() noexcept override { Destroy(); }
 
-      static FileMemSize CHUNK_SIZE;
+      // the kernel reads ahead into the page cache, the next pread only has
+      // to copy
+      void Prefetch(FilePosition offs, FilePosition len) noexcept override
+      { FAdvise(offs, len); }
+
+      FileMemSize CHUNK_SIZE;
       void* ReadChunk(FilePosition offs, FileMemSize size);
-      void DeleteChunk(size_t i);
+      void DeleteChunk(const Source::BufEntry& e) noexcept;
+
+      // evicted buffers (all CHUNK_SIZE large) are reused instead of freed
+      static constexpr std::size_t POOL_SIZE = 4;
+      std::unique_ptr<Byte[]> AllocChunk();
+      std::mutex pool_mutex;
+      std::vector<std::unique_ptr<Byte[]>> pool;
     };
 
     struct StringProvider final : public Source::Provider
@@ -78,6 +132,7 @@ namespace Neptools
 
       void Pread(FilePosition, Byte*, FileMemSize) override
       { LIBSHIT_UNREACHABLE("StringProvider Pread"); }
+      bool HasStableChunks() const noexcept override { return true; }
 
       std::string str;
     };
@@ -92,19 +147,69 @@ namespace Neptools
 
       void Pread(FilePosition, Byte*, FileMemSize) override
       { LIBSHIT_UNREACHABLE("UniquePtrProvider Pread"); }
+      bool HasStableChunks() const noexcept override { return true; }
 
       std::unique_ptr<char[]> data;
     };
 
+    // Piece table over other sources: unchanged ranges point into the base,
+    // patches into small memory sources. Also used to concatenate sources.
+    struct OverlayProvider final : public Source::Provider
+    {
+      struct Piece
+      {
+        FilePosition offset; // in the overlay
+        Source src;
+      };
+      using Pieces = std::vector<Piece>;
+
+      // collects pieces one after another, flattening overlays
+      struct Builder
+      {
+        void operator()(Source src)
+        {
+          if (!src.GetSize()) return;
+          pos += src.GetSize();
+          pieces.push_back({pos - src.GetSize(), Libshit::Move(src)});
+        }
+
+        Pieces pieces;
+        FilePosition pos = 0;
+      };
+
+      OverlayProvider(boost::filesystem::path file_name, Pieces pieces);
+
+      void Pread(FilePosition offs, Byte* buf, FileMemSize len) override;
+      bool HasStableChunks() const noexcept override { return stable; }
+      void SetSourcesThreadSafe(bool on) noexcept override
+      { for (auto& p : pieces) p.src.SetThreadSafe(on); }
+      void FreeChunk(const Source::BufEntry& e) noexcept override
+      { Release(e.ptr); }
+
+      const Piece& FindPiece(FilePosition offs) const noexcept;
+      const Source::BufEntry& EnsureChunk(FilePosition offs);
+      void Release(const Byte* ptr) noexcept;
+
+      Pieces pieces;
+      bool stable = true;
+
+      // chunks copied out of not stable pieces, freed on LRU eviction
+      std::mutex owned_mutex;
+      std::map<const Byte*, std::unique_ptr<Byte[]>> owned;
+    };
+
   }
 
 
-  Source Source::FromFile(const boost::filesystem::path& fname)
+  Source Source::FromFile(
+    const boost::filesystem::path& fname, const IoSettings& settings)
   {
-    LIBSHIT_ADD_INFOS(return FromFile_(fname), "File name", fname.string());
+    LIBSHIT_ADD_INFOS(return FromFile_(fname, settings),
+                      "File name", fname.string());
   }
 
-  Source Source::FromFile_(const boost::filesystem::path& fname)
+  Source Source::FromFile_(
+    const boost::filesystem::path& fname, const IoSettings& settings)
   {
     Libshit::LowIo io{fname.c_str(), Libshit::LowIo::Permission::READ_ONLY,
       Libshit::LowIo::Mode::OPEN_ONLY};
@@ -112,24 +217,30 @@ namespace Neptools
     FilePosition size = io.GetSize();
 
     Libshit::SmartPtr<Provider> p;
-    try { p = Libshit::MakeSmart<MmapProvider>(Libshit::Move(io), fname, size); }
+    try
+    {
+      p = Libshit::MakeSmart<MmapProvider>(
+        Libshit::Move(io), fname, size, settings);
+    }
     catch (const Libshit::SystemError& e)
     {
       WARN << "Mmap failed, falling back to normal reading: "
            << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
            << std::endl;
-      p = Libshit::MakeSmart<UnixProvider>(Libshit::Move(io), fname, size);
+      p = Libshit::MakeSmart<UnixProvider>(
+        Libshit::Move(io), fname, size, settings);
     }
     return Libshit::MakeNotNull(Libshit::Move(p));
   }
 
   Source Source::FromFd(
-    boost::filesystem::path fname, Libshit::LowIo::FdType fd, bool owning)
+    boost::filesystem::path fname, Libshit::LowIo::FdType fd, bool owning,
+    const IoSettings& settings)
   {
     Libshit::LowIo io{fd, owning};
     auto size = io.GetSize();
     return {Libshit::MakeSmart<UnixProvider>(
-        Libshit::Move(io), Libshit::Move(fname), size)};
+        Libshit::Move(io), Libshit::Move(fname), size, settings)};
   }
 
   Source Source::FromMemory(boost::filesystem::path fname, std::string str)
@@ -145,52 +256,159 @@ namespace Neptools
         Libshit::Move(fname), Libshit::Move(data), len)};
   }
 
+  Source Source::Replace(FilePosition offs, std::string data) const
+  {
+    if (offs > size || size - offs < data.size())
+      LIBSHIT_THROW(SourceOverflow, "Replace: invalid range", "Used source",
+                    *this, "Offset", offs, "Size", data.size());
+    auto len = data.size();
+    return Splice_(offs, len, Libshit::Move(data));
+  }
+
+  Source Source::Insert(FilePosition offs, std::string data) const
+  {
+    if (offs > size)
+      LIBSHIT_THROW(SourceOverflow, "Insert: invalid offset", "Used source",
+                    *this, "Offset", offs);
+    return Splice_(offs, 0, Libshit::Move(data));
+  }
+
+  template <typename Fun>
+  void Source::ForEachPiece_(FilePosition beg, FilePosition end, Fun&& fun) const
+  {
+    if (beg == end) return;
+    auto ov = dynamic_cast<OverlayProvider*>(p.get());
+    if (!ov) return fun(Source{*this, beg, end - beg});
+
+    beg += offset; end += offset;
+    for (auto it = &ov->FindPiece(beg);
+         it != ov->pieces.data() + ov->pieces.size() && it->offset < end; ++it)
+    {
+      auto pbeg = std::max(beg, it->offset);
+      auto pend = std::min(end, it->offset + it->src.GetSize());
+      fun(Source{it->src, pbeg - it->offset, pend - pbeg});
+    }
+  }
+
+  Source Source::Splice_(
+    FilePosition offs, FilePosition remove, std::string data) const
+  {
+    OverlayProvider::Builder bld;
+    ForEachPiece_(0, offs, bld);
+    bld(FromMemory(Libshit::Move(data)));
+    ForEachPiece_(offs + remove, size, bld);
+    return {Libshit::MakeSmart<OverlayProvider>(
+        GetFileName(), Libshit::Move(bld.pieces))};
+  }
+
+  Source Source::Concat(const std::vector<Source>& srcs)
+  {
+    if (srcs.empty()) return FromMemory("");
+    if (srcs.size() == 1) return srcs[0];
+
+    OverlayProvider::Builder bld;
+    for (const auto& s : srcs) s.ForEachPiece_(0, s.GetSize(), bld);
+    return {Libshit::MakeSmart<OverlayProvider>(
+        srcs[0].GetFileName(), Libshit::Move(bld.pieces))};
+  }
+
 
   void Source::Pread_(FilePosition offs, Byte* buf, FileMemSize len) const
   {
     offs += offset;
     while (len)
     {
-      if (p->LruGet(offs))
+      if (auto e = p->LruGet(offs))
       {
-        auto& x = p->lru[0];
+        auto& x = *e;
         auto buf_offs = offs - x.offset;
         auto to_cpy = std::min<FilePosition>(len, x.size - buf_offs);
         memcpy(buf, x.ptr + buf_offs, to_cpy);
+        p->Count(IoStats::LRU_HITS);
+        p->Count(IoStats::BYTES_COPIED, to_cpy);
         offs += to_cpy;
         buf += to_cpy;
         len -= to_cpy;
       }
       else
+      {
+        p->Count(IoStats::LRU_MISSES);
         return p->Pread(offs, buf, len);
+      }
     }
   }
 
-  std::string Source::PreadCString(FilePosition offs) const
+  std::string_view Source::GetContiguous_(
+    FilePosition offs, FileMemSize len, std::string& fallback) const
   {
-    std::string ret;
-    std::string_view e;
-    size_t len;
+    if (len == 0) return {};
+    auto e = GetChunk_(offs);
+    if (e.size() >= len)
+    {
+      p->Count(IoStats::BYTES_ZERO_COPY, len);
+      return e.substr(0, len);
+    }
+
+    fallback.resize(len);
+    Pread_(offs, reinterpret_cast<Byte*>(fallback.data()), len);
+    return fallback;
+  }
+
+  std::string_view Source::PreadCStringView(
+    FilePosition offs, std::string& fallback) const
+  {
+    auto e = GetChunk_(offs);
+    auto len = strnlen(e.data(), e.size());
+    if (len < e.size())
+    {
+      p->Count(IoStats::BYTES_ZERO_COPY, len);
+      return e.substr(0, len);
+    }
+
+    // straddles chunks, slow path
+    fallback.assign(e.data(), len);
     do
     {
-      e = GetChunk(offs);
-      len = strnlen(e.data(), e.size());
-      ret.append(e.data(), len);
       offs += e.size();
+      e = GetChunk_(offs);
+      len = strnlen(e.data(), e.size());
+      fallback.append(e.data(), len);
     } while (len == e.size());
+    p->Count(IoStats::BYTES_COPIED, fallback.size());
+    return fallback;
+  }
+
+  std::string Source::PreadCString(FilePosition offs) const
+  {
+    std::string ret;
+    auto view = PreadCStringView(offs, ret);
+    if (view.data() != ret.data()) ret.assign(view);
     return ret;
   }
 
   Source::BufEntry Source::GetTemporaryEntry(FilePosition offs) const
   {
-    if (p->LruGet(offs)) return p->lru[0];
+    auto& lru = p->GetLru();
+    if (auto e = lru.Get(offs))
+    {
+      p->Count(IoStats::LRU_HITS);
+      return *e;
+    }
+    p->Count(IoStats::LRU_MISSES);
     p->Pread(offs, nullptr, 0);
-    LIBSHIT_ASSERT(p->lru[0].offset <= offs &&
-                   p->lru[0].offset + p->lru[0].size > offs);
-    return p->lru[0];
+    auto& e = lru.Front();
+    LIBSHIT_ASSERT(e.offset <= offs && e.offset + e.size > offs);
+    return e;
   }
 
   std::string_view Source::GetChunk(FilePosition offs) const
+  {
+    auto ret = GetChunk_(offs);
+    p->Count(IoStats::BYTES_ZERO_COPY, ret.size());
+    return ret;
+  }
+
+  std::string_view Source::GetChunk_(FilePosition offs) const
   {
     LIBSHIT_ASSERT(offs < size);
     auto e = GetTemporaryEntry(offs + offset);
@@ -200,52 +418,210 @@ namespace Neptools
   }
 
 
-  void Source::Provider::LruPush(
-    const Byte* ptr, FilePosition offset, FileMemSize size)
+  void Source::Provider::SetThreadSafe(bool on) noexcept
+  {
+    static std::atomic<std::uint64_t> next_id{0};
+    if (on)
+    {
+      SetSourcesThreadSafe(true);
+      if (thread_safe_count++) return;
+      thread_safe_id = ++next_id;
+      thread_safe = true;
+    }
+    else
+    {
+      LIBSHIT_ASSERT(thread_safe_count);
+      if (--thread_safe_count == 0)
+      {
+        // the shared entries are still in lru
+        for (auto& tl : thread_lrus)
+          tl.second.ForEach(
+            [&](auto& e) { if (e.size && !IsShared(e)) FreeChunk(e); });
+        thread_lrus.clear();
+        thread_safe = false;
+      }
+      SetSourcesThreadSafe(false);
+    }
+  }
+
+  auto Source::Provider::GetLru() -> Lru&
+  {
+    if (!thread_safe) return lru;
+
+    // thread_safe_id is unique for the lifetime of the process, so a stale
+    // cache entry never matches a provider allocated at the same address
+    thread_local struct { std::uint64_t id = 0; Lru* lru = nullptr; } cache;
+    if (cache.id == thread_safe_id) return *cache.lru;
+
+    std::lock_guard lock{thread_lrus_mutex};
+    // std::map never invalidates references on insert
+    auto [it, inserted] = thread_lrus.try_emplace(
+      std::this_thread::get_id(), lru);
+    cache.id = thread_safe_id;
+    cache.lru = &it->second;
+    return it->second;
+  }
+
+  bool Source::Provider::IsShared(const BufEntry& e) const noexcept
+  {
+    if (!thread_safe || !e.size) return false;
+    bool ret = false;
+    lru.ForEach([&](auto& x) { ret = ret || x.ptr == e.ptr; });
+    return ret;
+  }
+
+  Source::Provider::Lru::Lru(std::size_t capacity, FileMemSize chunk_size)
+    : nodes(std::max<std::size_t>(capacity, 1)), chunk_size{chunk_size}
+  {
+    LIBSHIT_ASSERT(nodes.size() < NONE);
+    if (chunk_size)
+    {
+      // load factor <= 0.5, power of two
+      std::size_t n = 2;
+      while (n < 2*nodes.size()) n *= 2;
+      index.resize(n, NONE);
+    }
+  }
+
+  auto Source::Provider::Lru::Get(FilePosition offs) noexcept
+    -> const BufEntry*
+  {
+    auto contains = [offs](const BufEntry& e)
+    { return e.offset <= offs && e.offset + e.size > offs; };
+    if (head == NONE) return nullptr;
+    if (contains(nodes[head].entry)) return &nodes[head].entry;
+
+    auto found = NONE;
+    if (chunk_size)
+      for (auto i = Slot(offs / chunk_size); index[i] != NONE;
+           i = (i+1) & (index.size()-1))
+        if (contains(nodes[index[i]].entry))
+        {
+          found = index[i];
+          break;
+        }
+
+    if (found == NONE && not_indexed)
+      for (auto i = nodes[head].next; i != NONE; i = nodes[i].next)
+        if (contains(nodes[i].entry))
+        {
+          found = i;
+          break;
+        }
+
+    if (found == NONE) return nullptr;
+    LIBSHIT_ASSERT(nodes[found].entry.ptr);
+    Unlink(found);
+    LinkFront(found);
+    return &nodes[found].entry;
+  }
+
+  auto Source::Provider::Lru::Push(
+    const Byte* ptr, FilePosition offset, FileMemSize size) -> BufEntry
+  {
+    BufEntry evicted;
+    std::uint32_t n;
+    if (used < nodes.size()) n = used++;
+    else
+    {
+      n = tail;
+      evicted = nodes[n].entry;
+      IndexRemove(n);
+      Unlink(n);
+    }
+
+    nodes[n].entry = {ptr, offset, size};
+    LinkFront(n);
+    IndexAdd(n);
+    return evicted;
+  }
+
+  auto Source::Provider::Lru::Front() const noexcept -> const BufEntry&
+  {
+    LIBSHIT_ASSERT(head != NONE);
+    return nodes[head].entry;
+  }
+
+  bool Source::Provider::Lru::IsIndexed(const BufEntry& e) const noexcept
+  {
+    return chunk_size && e.offset % chunk_size == 0 && e.size <= chunk_size;
+  }
+
+  std::size_t Source::Provider::Lru::Slot(FilePosition key) const noexcept
+  {
+    // fibonacci hashing, consecutive chunks spread over the table
+    return (key * 0x9e3779b97f4a7c15ull) >> 32 & (index.size()-1);
+  }
+
+  void Source::Provider::Lru::IndexAdd(std::uint32_t n) noexcept
   {
-    memmove(&lru[1], &lru[0], sizeof(BufEntry)*(lru.size()-1));
-    lru[0].ptr = ptr;
-    lru[0].offset = offset;
-    lru[0].size = size;
+    if (!IsIndexed(nodes[n].entry)) { ++not_indexed; return; }
+    auto i = Slot(nodes[n].entry.offset / chunk_size);
+    while (index[i] != NONE) i = (i+1) & (index.size()-1);
+    index[i] = n;
   }
 
-  bool Source::Provider::LruGet(FilePosition offs)
+  void Source::Provider::Lru::IndexRemove(std::uint32_t n) noexcept
   {
-    for (size_t i = 0; i < lru.size(); ++i)
+    if (!IsIndexed(nodes[n].entry)) { --not_indexed; return; }
+    auto mask = index.size()-1;
+    auto i = Slot(nodes[n].entry.offset / chunk_size);
+    while (index[i] != n) i = (i+1) & mask;
+
+    // backward shift deletion, no tombstones
+    for (auto j = (i+1) & mask; index[j] != NONE; j = (j+1) & mask)
     {
-      auto x = lru[i];
-      if (x.offset <= offs && x.offset + x.size > offs)
+      auto home = Slot(nodes[index[j]].entry.offset / chunk_size);
+      // move j into the hole at i if its home isn't cyclically in (i, j]
+      if (((j - home) & mask) >= ((j - i) & mask))
       {
-        LIBSHIT_ASSERT(x.ptr);
-        memmove(&lru[1], &lru[0], sizeof(BufEntry)*i);
-        lru[0] = x;
-        return true;
+        index[i] = index[j];
+        i = j;
       }
     }
-    return false;
+    index[i] = NONE;
+  }
+
+  void Source::Provider::Lru::Unlink(std::uint32_t n) noexcept
+  {
+    auto& x = nodes[n];
+    (x.prev == NONE ? head : nodes[x.prev].next) = x.next;
+    (x.next == NONE ? tail : nodes[x.next].prev) = x.prev;
+  }
+
+  void Source::Provider::Lru::LinkFront(std::uint32_t n) noexcept
+  {
+    nodes[n].prev = NONE;
+    nodes[n].next = head;
+    (head == NONE ? tail : nodes[head].prev) = n;
+    head = n;
   }
 
   template <typename T>
   void UnixLike<T>::Destroy() noexcept
   {
-    for (size_t i = 0; i < lru.size(); ++i)
-      if (lru[i].size)
-        static_cast<T*>(this)->DeleteChunk(i);
+    ForEachChunk([this](auto& e) { static_cast<T*>(this)->DeleteChunk(e); });
   }
 
   template <typename T>
   void UnixLike<T>::Pread(FilePosition offs, Byte* buf, FileMemSize len)
   {
     if (len > static_cast<T*>(this)->CHUNK_SIZE)
-      return io.Pread(buf, len, offs);
+    {
+      io.Pread(buf, len, offs);
+      Count(IoStats::SYSCALLS);
+      Count(IoStats::BYTES_COPIED, len);
+      return;
+    }
 
     if (len == 0) EnsureChunk(offs); // TODO: GetTemporaryEntry hack
     while (len)
     {
-      EnsureChunk(offs);
-      auto buf_offs = offs - lru[0].offset;
-      auto to_cpy = std::min<FilePosition>(len, lru[0].size - buf_offs);
-      memcpy(buf, lru[0].ptr + buf_offs, to_cpy);
+      auto& e = EnsureChunk(offs);
+      auto buf_offs = offs - e.offset;
+      auto to_cpy = std::min<FilePosition>(len, e.size - buf_offs);
+      memcpy(buf, e.ptr + buf_offs, to_cpy);
+      Count(IoStats::BYTES_COPIED, to_cpy);
       buf += to_cpy;
       offs += to_cpy;
       len -= to_cpy;
@@ -253,60 +629,455 @@ namespace Neptools
   }
 
   template <typename T>
-  void UnixLike<T>::EnsureChunk(FilePosition offs)
+  const Source::BufEntry& UnixLike<T>::EnsureChunk(FilePosition offs)
   {
     auto const CHUNK_SIZE = static_cast<T*>(this)->CHUNK_SIZE;
     auto ch_offs = offs/CHUNK_SIZE*CHUNK_SIZE;
-    if (LruGet(offs)) return;
+    auto& lru = GetLru();
+    if (auto e = lru.Get(offs)) return *e;
 
     auto size = std::min<FilePosition>(CHUNK_SIZE, this->size-ch_offs);
     auto x = static_cast<T*>(this)->ReadChunk(ch_offs, size);
-    static_cast<T*>(this)->DeleteChunk(lru.size()-1);
-    LruPush(static_cast<Byte*>(x), ch_offs, size);
+    auto evicted = lru.Push(static_cast<Byte*>(x), ch_offs, size);
+    // shared entries belong to every thread, only the provider can free them
+    if (evicted.size && !IsShared(evicted))
+      static_cast<T*>(this)->DeleteChunk(evicted);
+
+    if (!IsThreadSafe())
+    {
+      if (ch_offs == seq_next) ++seq_count;
+      else seq_count = 0;
+      seq_next = ch_offs + size;
+      if (seq_count >= SEQ_THRESHOLD && seq_next < this->size)
+        static_cast<T*>(this)->Prefetch(seq_next, CHUNK_SIZE);
+    }
+    return lru.Front();
+  }
+
+  template <typename T>
+  void UnixLike<T>::FAdvise(FilePosition offs, FilePosition len) noexcept
+  {
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA && defined(POSIX_FADV_WILLNEED)
+    // only a hint, ignore errors
+    posix_fadvise(io.fd, offs, len, POSIX_FADV_WILLNEED);
+#else
+    (void) offs; (void) len;
+#endif
+  }
+
+  OverlayProvider::OverlayProvider(
+    boost::filesystem::path file_name, Pieces pieces_in)
+    : Source::Provider{Libshit::Move(file_name), 0},
+      pieces{Libshit::Move(pieces_in)}
+  {
+    for (const auto& p : pieces)
+    {
+      LIBSHIT_ASSERT(p.offset == size);
+      size += p.src.GetSize();
+      stable = stable && p.src.HasStableChunks();
+    }
+  }
+
+  auto OverlayProvider::FindPiece(FilePosition offs) const noexcept
+    -> const Piece&
+  {
+    LIBSHIT_ASSERT(offs < size);
+    auto it = std::upper_bound(
+      pieces.begin(), pieces.end(), offs,
+      [](FilePosition o, const Piece& p) { return o < p.offset; });
+    LIBSHIT_ASSERT(it != pieces.begin());
+    return *--it;
+  }
+
+  void OverlayProvider::Pread(FilePosition offs, Byte* buf, FileMemSize len)
+  {
+    if (len == 0) EnsureChunk(offs); // GetTemporaryEntry hack
+    while (len)
+    {
+      auto& e = EnsureChunk(offs);
+      auto buf_offs = offs - e.offset;
+      auto to_cpy = std::min<FilePosition>(len, e.size - buf_offs);
+      memcpy(buf, e.ptr + buf_offs, to_cpy);
+      Count(IoStats::BYTES_COPIED, to_cpy);
+      buf += to_cpy;
+      offs += to_cpy;
+      len -= to_cpy;
+    }
+  }
+
+  const Source::BufEntry& OverlayProvider::EnsureChunk(FilePosition offs)
+  {
+    auto& lru = GetLru();
+    if (auto e = lru.Get(offs)) return *e;
+
+    auto& p = FindPiece(offs);
+    auto rel = offs - p.offset;
+    auto chunk = p.src.GetChunk(rel);
+    const Byte* ptr;
+    if (p.src.HasStableChunks())
+      ptr = reinterpret_cast<const Byte*>(chunk.data());
+    else
+    {
+      // the view dies with the piece's LRU entry, keep a copy
+      std::unique_ptr<Byte[]> x{new Byte[chunk.size()]};
+      memcpy(x.get(), chunk.data(), chunk.size());
+      Count(IoStats::BYTES_COPIED, chunk.size());
+      ptr = x.get();
+      std::lock_guard lock{owned_mutex};
+      owned.emplace(ptr, Libshit::Move(x));
+    }
+
+    auto evicted = lru.Push(ptr, offs, chunk.size());
+    if (!IsShared(evicted)) Release(evicted.ptr);
+    return lru.Front();
+  }
+
+  void OverlayProvider::Release(const Byte* ptr) noexcept
+  {
+    if (stable || !ptr) return;
+    std::lock_guard lock{owned_mutex};
+    owned.erase(ptr);
+  }
+
+  IoSettings& GetIoSettings() noexcept
+  {
+    static IoSettings settings;
+    return settings;
+  }
+
+  const char* const IoStats::NAMES[COUNTER_COUNT] = {
+    "lru_hits", "lru_misses", "maps", "unmaps", "syscalls", "bytes_copied",
+    "bytes_zero_copy", "bytes_kernel_copy",
+  };
+
+  void IoStats::Add(const IoStats& o) noexcept
+  {
+    for (std::size_t i = 0; i < COUNTER_COUNT; ++i)
+      Add(Counter(i), o.Get(Counter(i)));
+  }
+
+  void IoStats::Reset() noexcept
+  {
+    for (auto& c : counters) c.store(0, std::memory_order_relaxed);
   }
 
-  FileMemSize MmapProvider::CHUNK_SIZE = MMAP_CHUNK;
+  void IoStats::Print(std::ostream& os) const
+  {
+    for (std::size_t i = 0; i < COUNTER_COUNT; ++i)
+      os << NAMES[i] << ": " << Get(Counter(i)) << '\n';
+
+    auto lookups = Get(LRU_HITS) + Get(LRU_MISSES);
+    if (lookups)
+      os << "lru_hit_rate: " << 100.0 * Get(LRU_HITS) / lookups << "%\n";
+  }
+
+  namespace
+  {
+    // every live provider and the sum of the destroyed ones, so reads don't
+    // have to update a process-wide counter
+    struct IoStatsRegistry
+    {
+      std::mutex mutex;
+      boost::intrusive::list<
+        Source::Provider, boost::intrusive::constant_time_size<false>> providers;
+      IoStats destroyed;
+    };
+  }
+
+  static IoStatsRegistry& GetIoStatsRegistry() noexcept
+  {
+    static IoStatsRegistry reg;
+    return reg;
+  }
+
+  IoStats GetIoStats()
+  {
+    auto& reg = GetIoStatsRegistry();
+    std::lock_guard lock{reg.mutex};
+    IoStats ret{reg.destroyed};
+    for (const auto& p : reg.providers) ret.Add(p.stats);
+    return ret;
+  }
+
+  // the registry is created before the first provider, so it's destroyed
+  // after every static one
+  Source::Provider::Provider(
+    boost::filesystem::path file_name, FilePosition size)
+    : file_name{Libshit::Move(file_name)}, size{size}
+  {
+    auto& reg = GetIoStatsRegistry();
+    std::lock_guard lock{reg.mutex};
+    reg.providers.push_back(*this);
+  }
+
+  Source::Provider::~Provider() noexcept
+  {
+    auto& reg = GetIoStatsRegistry();
+    std::lock_guard lock{reg.mutex};
+    reg.destroyed.Add(stats);
+    reg.providers.erase(reg.providers.iterator_to(*this));
+  }
+
+  static FilePosition ParseSize(const char* str)
+  {
+    char* end;
+    errno = 0;
+    auto ret = std::strtoull(str, &end, 0);
+    if (errno || end == str) throw Libshit::InvalidParam{"invalid size"};
+    unsigned long long mul = 1;
+    switch (*end)
+    {
+    case 'k': case 'K': mul = 1024; ++end; break;
+    case 'm': case 'M': mul = 1024*1024; ++end; break;
+    case 'g': case 'G': mul = 1024*1024*1024; ++end; break;
+    }
+    if (*end || ret > std::numeric_limits<FilePosition>::max() / mul)
+      throw Libshit::InvalidParam{"invalid size"};
+    return ret * mul;
+  }
+
+  static Libshit::Option mmap_limit_opt{
+    GetIoOptions(), "mmap-limit", 1, "SIZE",
+    "Map input files up to SIZE bytes as a whole, use windows above it "
+    "(default: unlimited on 64-bit, 1M on 32-bit)",
+    [](auto&& args)
+    { GetIoSettings().whole_file_limit = ParseSize(args.front()); }};
+  static Libshit::Option mmap_chunk_opt{
+    GetIoOptions(), "mmap-chunk", 1, "SIZE",
+    "Size of mmap windows, must be a multiple of 64K (default: 128K)",
+    [](auto&& args)
+    {
+      auto size = ParseSize(args.front());
+      if (size == 0 || size % (64*1024))
+        throw Libshit::InvalidParam{"invalid mmap chunk size"};
+      GetIoSettings().chunk_size = size;
+    }};
+  static Libshit::Option mmap_access_opt{
+    GetIoOptions(), "mmap-access", 1, "PATTERN",
+    "Access pattern hint of input files: normal, sequential or random",
+    [](auto&& args)
+    {
+      auto& acc = GetIoSettings().access;
+      if (strcmp(args.front(), "normal") == 0) acc = AccessPattern::NORMAL;
+      else if (strcmp(args.front(), "sequential") == 0)
+        acc = AccessPattern::SEQUENTIAL;
+      else if (strcmp(args.front(), "random") == 0) acc = AccessPattern::RANDOM;
+      else throw Libshit::InvalidParam{"invalid argument"};
+    }};
+  static Libshit::Option mmap_populate_opt{
+    GetIoOptions(), "mmap-populate", 0, nullptr,
+    "Read whole mapped input files in advance",
+    [](auto&&) { GetIoSettings().populate = true; }};
+  static Libshit::Option read_chunk_opt{
+    GetIoOptions(), "read-chunk", 1, "SIZE",
+    "Size of read buffers when a file is not mapped (default: 8K)",
+    [](auto&& args)
+    {
+      auto size = ParseSize(args.front());
+      if (size == 0) throw Libshit::InvalidParam{"invalid read chunk size"};
+      GetIoSettings().read_chunk_size = size;
+    }};
+  static Libshit::Option cache_slots_opt{
+    GetIoOptions(), "io-cache-slots", 1, "N",
+    "Number of mmap windows or read buffers kept per file (default: 4)",
+    [](auto&& args)
+    {
+      auto n = ParseSize(args.front());
+      if (n == 0 || n > 1024*1024)
+        throw Libshit::InvalidParam{"invalid cache slot count"};
+      GetIoSettings().cache_slots = n;
+    }};
+  static Libshit::Option dump_jobs_opt{
+    GetIoOptions(), "dump-jobs", 1, "N",
+    "Number of threads writing files in parallel (default: number of CPUs)",
+    [](auto&& args)
+    {
+      auto n = ParseSize(args.front());
+      if (n == 0 || n > 1024)
+        throw Libshit::InvalidParam{"invalid job count"};
+      GetIoSettings().dump_jobs = n;
+    }};
+  static Libshit::Option write_if_changed_opt{
+    GetIoOptions(), "write-if-changed", 0, nullptr,
+    "Compare output files with their existing version and leave them alone "
+    "when they wouldn't change",
+    [](auto&&) { GetIoSettings().write_if_changed = true; }};
+  static Libshit::Option write_behind_opt{
+    GetIoOptions(), "write-behind", 0, nullptr,
+    "Write output files in a background thread",
+    [](auto&&) { GetIoSettings().write_behind = true; }};
+  static Libshit::Option write_buffer_opt{
+    GetIoOptions(), "write-buffer", 1, "SIZE",
+    "Size of write behind buffers (default: 1M)",
+    [](auto&& args)
+    {
+      auto size = ParseSize(args.front());
+      if (size == 0) throw Libshit::InvalidParam{"invalid write buffer size"};
+      GetIoSettings().write_buffer_size = size;
+    }};
+  static Libshit::Option io_stats_opt{
+    GetIoOptions(), "io-stats", 0, nullptr,
+    "Print I/O statistics of input files to stderr on exit",
+    [](auto&&)
+    {
+      static bool registered = false;
+      if (registered) return;
+      registered = true;
+      // construct the registry before registering, so it still exists when
+      // the handler runs
+      GetIoStats();
+      std::atexit([]()
+      {
+        std::cerr << "I/O statistics:\n";
+        GetIoStats().Print(std::cerr);
+      });
+    }};
+
   MmapProvider::MmapProvider(
-    Libshit::LowIo&& io, boost::filesystem::path file_name, FilePosition size)
+    Libshit::LowIo&& io, boost::filesystem::path file_name, FilePosition size,
+    const IoSettings& settings)
     : UnixLike{{}, Libshit::Move(file_name), size}
   {
-    std::size_t to_map = size < MMAP_LIMIT ? size : MMAP_CHUNK;
+    CHUNK_SIZE = settings.chunk_size;
+    access = settings.access;
+    InitLru(settings);
 
     io.PrepareMmap(false);
-    void* ptr = io.Mmap(0, to_map, false).Release();
-#if !LIBSHIT_OS_IS_WINDOWS
-    if (to_map == size) io.Reset();
-#endif
+    void* ptr = nullptr;
+    std::size_t to_map = 0;
+    if (size <= settings.whole_file_limit &&
+        size <= std::numeric_limits<std::size_t>::max())
+    {
+      try
+      {
+        ptr = io.Mmap(0, size, false).Release();
+        to_map = size;
+        Count(IoStats::MAPS);
+      }
+      catch (const Libshit::SystemError&)
+      {
+        // most likely out of address space, windows should still work
+        DBG(1) << "Mapping " << this->file_name << " as a whole failed: "
+               << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
+               << std::endl;
+      }
+    }
+    if (!ptr)
+    {
+      to_map = std::min<FilePosition>(size, CHUNK_SIZE);
+      ptr = io.Mmap(0, to_map, false).Release();
+      Count(IoStats::MAPS);
+    }
+    Count(IoStats::SYSCALLS);
+    whole = to_map == size;
+    // keep the fd even if the file is mapped as a whole, Source::DumpPiece_
+    // passes it to the sink for kernel copies
     this->io = Libshit::Move(io);
 
-    lru[0].ptr = static_cast<Byte*>(ptr);
-    lru[0].offset = 0;
-    lru[0].size = to_map;
+    if (to_map) LruPush(static_cast<Byte*>(ptr), 0, to_map);
+
+    Advise(static_cast<Byte*>(ptr), to_map);
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA
+    // LowIo::Mmap can't pass MAP_POPULATE, WILLNEED starts the same readahead
+    if (settings.populate && to_map == size && to_map)
+      posix_madvise(ptr, to_map, POSIX_MADV_WILLNEED);
+#endif
   }
 
   void* MmapProvider::ReadChunk(FilePosition offs, FileMemSize size)
   {
-    return io.Mmap(offs, size, false).Release();
+    auto ret = io.Mmap(offs, size, false).Release();
+    Count(IoStats::MAPS);
+    Count(IoStats::SYSCALLS);
+    Advise(static_cast<Byte*>(ret), size);
+    return ret;
+  }
+
+  void MmapProvider::Advise(const Byte* ptr, FileMemSize size) noexcept
+  {
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA
+    if (!ptr || !size) return;
+    int adv;
+    switch (access)
+    {
+    case AccessPattern::NORMAL:     adv = POSIX_MADV_NORMAL;     break;
+    case AccessPattern::SEQUENTIAL: adv = POSIX_MADV_SEQUENTIAL; break;
+    case AccessPattern::RANDOM:     adv = POSIX_MADV_RANDOM;     break;
+    default: return;
+    }
+    // only a hint, ignore errors
+    posix_madvise(const_cast<Byte*>(ptr), size, adv);
+#else
+    (void) ptr; (void) size;
+#endif
+  }
+
+  void MmapProvider::Prefetch(FilePosition offs, FilePosition len) noexcept
+  {
+#if !LIBSHIT_OS_IS_WINDOWS && !LIBSHIT_OS_IS_VITA
+    // not GetLru, that can throw. In thread safe mode this only sees the
+    // shared entries, which are never unmapped
+    const Source::BufEntry* found = nullptr;
+    lru.ForEach([&](const auto& e)
+    { if (e.offset <= offs && e.offset + e.size > offs) found = &e; });
+    if (found)
+    {
+      auto& e = *found;
+      static const auto page_size = sysconf(_SC_PAGESIZE);
+      auto beg = (offs - e.offset) / page_size * page_size;
+      auto end = std::min<FilePosition>(offs - e.offset + len, e.size);
+      posix_madvise(const_cast<Byte*>(e.ptr) + beg, end - beg,
+                    POSIX_MADV_WILLNEED);
+      return;
+    }
+#endif
+    // not mapped yet, let the page cache know
+    FAdvise(offs, len);
   }
 
-  void MmapProvider::DeleteChunk(size_t i)
+  void MmapProvider::SetAccessPattern(AccessPattern pat)
   {
-    if (lru[i].ptr)
-      Libshit::LowIo::Munmap(const_cast<Byte*>(lru[i].ptr), lru[i].size);
+    access = pat;
+    ForEachChunk([this](auto& e) { Advise(e.ptr, e.size); });
   }
 
-  FileMemSize UnixProvider::CHUNK_SIZE = MEM_CHUNK;
+  void MmapProvider::DeleteChunk(const Source::BufEntry& e) noexcept
+  {
+    if (e.ptr)
+    {
+      Libshit::LowIo::Munmap(const_cast<Byte*>(e.ptr), e.size);
+      Count(IoStats::UNMAPS);
+      Count(IoStats::SYSCALLS);
+    }
+  }
 
   void* UnixProvider::ReadChunk(FilePosition offs, FileMemSize size)
   {
-    std::unique_ptr<Byte[]> x{new Byte[size]};
+    auto x = AllocChunk();
     io.Pread(x.get(), size, offs);
+    Count(IoStats::SYSCALLS);
     return x.release();
   }
 
-  void UnixProvider::DeleteChunk(size_t i)
+  std::unique_ptr<Byte[]> UnixProvider::AllocChunk()
+  {
+    {
+      std::lock_guard lock{pool_mutex};
+      if (!pool.empty())
+      {
+        auto ret = Libshit::Move(pool.back());
+        pool.pop_back();
+        return ret;
+      }
+    }
+    return std::unique_ptr<Byte[]>{new Byte[CHUNK_SIZE]};
+  }
+
+  void UnixProvider::DeleteChunk(const Source::BufEntry& e) noexcept
   {
-    delete[] lru[i].ptr;
+    std::unique_ptr<Byte[]> x{const_cast<Byte*>(e.ptr)};
+    std::lock_guard lock{pool_mutex};
+    if (pool.size() < POOL_SIZE) pool.push_back(Libshit::Move(x));
   }
 
   void Source::Inspect(std::ostream& os) const
@@ -325,14 +1096,32 @@ namespace Neptools
 
   void Source::Dump(Sink& sink) const
   {
-    FilePosition offset = 0;
-    auto size = GetSize();
-    while (offset < size)
+    ForEachPiece_(0, size, [&](const Source& s) { s.DumpPiece_(sink); });
+  }
+
+  void Source::DumpPiece_(Sink& sink) const
+  {
+    FilePosition pos = 0;
+    // file to file: let the kernel copy it, if the sink can
+    if (auto io = p->GetLowIo())
+    {
+      pos = sink.CopyFrom(*io, offset, size);
+      p->Count(IoStats::BYTES_KERNEL_COPY, pos);
+    }
+    if (pos == size) return;
+
+    Prefetch(pos, size - pos);
+    // stable chunks can be written by the sink without copying, but they're
+    // only guaranteed to be valid while this source is alive
+    auto ref = HasStableChunks();
+    while (pos < size)
     {
-      auto chunk = GetChunk(offset);
-      sink.Write(chunk);
-      offset += chunk.size();
+      auto chunk = GetChunk(pos);
+      if (ref) sink.WriteRef(chunk);
+      else sink.Write(chunk);
+      pos += chunk.size();
     }
+    if (ref) sink.Flush();
   }
 
   void DumpableSource::Inspect_(std::ostream& os, unsigned) const
@@ -371,8 +1160,59 @@ namespace Neptools
     return {1};
   }
 
+  // neptools.source.concat({src0, src1, ...})
+  LIBSHIT_LUAGEN(name="concat")
+  static Source LuaConcat(
+    Libshit::Lua::StateRef vm, Libshit::Lua::RawTable tbl)
+  {
+    auto [len, one] = vm.RawLen01(tbl);
+    std::vector<Source> srcs;
+    srcs.reserve(len);
+    vm.Fori(tbl, one, len, [&](std::size_t, int)
+    { srcs.push_back(vm.Get<Source>()); });
+    return Source::Concat(srcs);
+  }
+
+  static void PushIoStats(Libshit::Lua::StateRef vm, const IoStats& stats)
+  {
+    lua_createtable(vm, 0, IoStats::COUNTER_COUNT);
+    for (std::size_t i = 0; i < IoStats::COUNTER_COUNT; ++i)
+    {
+      lua_pushinteger(vm, stats.Get(IoStats::Counter(i)));
+      lua_setfield(vm, -2, IoStats::NAMES[i]);
+    }
+  }
+
+  // counters of one provider: src:get_io_stats()
+  LIBSHIT_LUAGEN(name="get_io_stats")
+  static Libshit::Lua::RetNum LuaGetIoStats(
+    Libshit::Lua::StateRef vm, const Source& src)
+  {
+    PushIoStats(vm, src.GetProviderIoStats());
+    return {1};
+  }
+
+  // process-wide counters: neptools.source.get_io_stats()
+  LIBSHIT_LUAGEN(name="get_io_stats")
+  static Libshit::Lua::RetNum LuaGetIoStats(Libshit::Lua::StateRef vm)
+  {
+    PushIoStats(vm, GetIoStats());
+    return {1};
+  }
+
 #endif
 
+  TEST_CASE("parse size")
+  {
+    CHECK(ParseSize("123") == 123);
+    CHECK(ParseSize("0x10k") == 16*1024);
+    CHECK(ParseSize("3G") == 3ull*1024*1024*1024);
+    CHECK_THROWS(ParseSize(""));
+    CHECK_THROWS(ParseSize("12x"));
+    CHECK_THROWS(ParseSize("99999999999G"));
+    CHECK_THROWS(ParseSize("99999999999999999999"));
+  }
+
   TEST_CASE("small source")
   {
     char buf[16] = {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15};
@@ -387,6 +1227,470 @@ namespace Neptools
     CHECK(src.Inspect() ==
           R"(neptools.source.from_memory("tmp", "\x00\x01\x02\x03\x04\x05\x06\a\b\t\n\v\f\r\x0e\x0f"))");
   }
+
+  TEST_CASE("contiguous views")
+  {
+    std::string data(3*1024*1024, 'x');
+    data[10] = '\0';
+    data[2*1024*1024] = '\0';
+    std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), data.size());
+
+    auto& settings = GetIoSettings();
+    auto old_limit = settings.whole_file_limit;
+    settings.whole_file_limit = 0;
+    auto src = Source::FromFile("tmp");
+    settings.whole_file_limit = old_limit;
+
+    std::string fallback;
+    auto v = src.PreadCStringView(0, fallback);
+    CHECK(v == std::string_view(data.data(), 10));
+    CHECK(fallback.empty()); // no copy
+
+    v = src.PreadCStringView(11, fallback);
+    CHECK(v.size() == 2*1024*1024 - 11);
+    CHECK(v.data() == fallback.data()); // straddles windows
+    CHECK(src.PreadCString(11) == v);
+
+    v = src.GetContiguous(100, 16, fallback);
+    CHECK(v == std::string(16, 'x'));
+    v = src.GetContiguous(MMAP_CHUNK-8, 16, fallback);
+    CHECK(v.data() == fallback.data());
+    CHECK(v == std::string(16, 'x'));
+  }
+
+  TEST_CASE("lru")
+  {
+    Byte buf[1];
+    SUBCASE("chunked")
+    {
+      Source::Provider::Lru lru{3, 16};
+      CHECK(lru.Get(0) == nullptr);
+      CHECK(lru.Push(buf, 0, 16).size == 0);
+      CHECK(lru.Push(buf, 16*64, 16).size == 0);
+      CHECK(lru.Push(buf, 32, 10).size == 0);
+      REQUIRE(lru.Get(5));
+      CHECK(lru.Get(5)->offset == 0);
+      CHECK(lru.Get(16*64+15)->offset == 16*64);
+      CHECK(lru.Get(41)->offset == 32);
+      CHECK(lru.Get(42) == nullptr);
+      CHECK(lru.Get(16) == nullptr);
+
+      // 0 is the least recently used
+      auto ev = lru.Push(buf, 48, 16);
+      CHECK(ev.offset == 0);
+      CHECK(lru.Get(0) == nullptr);
+      CHECK(lru.Get(16*64)->offset == 16*64);
+      CHECK(lru.Front().offset == 16*64);
+      CHECK(lru.Get(50)->offset == 48);
+    }
+
+    SUBCASE("unaligned")
+    {
+      Source::Provider::Lru lru{2, 16};
+      lru.Push(buf, 0, 1000); // whole file, not indexed
+      lru.Push(buf, 2000, 16);
+      CHECK(lru.Get(999)->offset == 0);
+      CHECK(lru.Get(2001)->offset == 2000);
+      CHECK(lru.Push(buf, 3000, 3).offset == 0);
+      CHECK(lru.Get(10) == nullptr);
+    }
+
+    SUBCASE("many")
+    {
+      static constexpr FilePosition CH = 8;
+      Source::Provider::Lru lru{64, CH};
+      std::mt19937 gen{42};
+      std::uniform_int_distribution<FilePosition> dist{0, 200};
+      std::vector<FilePosition> shadow; // most recent first
+      for (int i = 0; i < 5000; ++i)
+      {
+        auto ch = dist(gen) * CH;
+        auto it = std::find(shadow.begin(), shadow.end(), ch);
+        auto e = lru.Get(ch + 3);
+        REQUIRE((e != nullptr) == (it != shadow.end()));
+        if (e)
+        {
+          CHECK(e->offset == ch);
+          shadow.erase(it);
+        }
+        else
+        {
+          auto ev = lru.Push(buf, ch, CH);
+          if (shadow.size() == 64)
+          {
+            CHECK(ev.offset == shadow.back());
+            shadow.pop_back();
+          }
+        }
+        shadow.insert(shadow.begin(), ch);
+      }
+    }
+  }
+
+  // Not a real benchmark, only reports the hit rate of a cl3-like access
+  // pattern: walking the file entries, each with a link table lookup and a
+  // string, while reading the file data sequentially.
+  TEST_CASE("cache hit rate")
+  {
+    static constexpr FilePosition SIZE = 4*1024*1024;
+    {
+      std::string data(SIZE, 'x');
+      std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), SIZE);
+    }
+
+    auto run = [](std::size_t slots)
+    {
+      IoSettings settings;
+      settings.cache_slots = slots;
+      Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+        Libshit::LowIo::Mode::OPEN_ONLY};
+      Source src{Libshit::MakeSmart<UnixProvider>(
+          Libshit::Move(io), "tmp", SIZE, settings)};
+
+      std::mt19937 gen{1};
+      std::uniform_int_distribution<FilePosition> link{0, 4095};
+      char buf[64];
+      for (FilePosition i = 0; i < 2048; ++i)
+      {
+        src.Pread(0x100 + i*0x200 % 0x10000, buf, 0x40); // file entry
+        src.Pread(0x10000 + link(gen)*4, buf, 4);         // link entry
+        src.Pread(0x20000 + i*16 % 0x4000, buf, 16);      // string
+        src.Pread(0x100000 + i*1024, buf, 64);            // data
+      }
+
+      auto& st = src.GetProviderIoStats();
+      auto hits = st.Get(IoStats::LRU_HITS);
+      return double(hits) / (hits + st.Get(IoStats::LRU_MISSES));
+    };
+
+    auto r4 = run(4), r16 = run(16), r64 = run(64);
+    MESSAGE("hit rate with 4 slots: " << r4 << ", 16 slots: " << r16
+            << ", 64 slots: " << r64);
+    CHECK(r16 > r4);
+    CHECK(r64 >= r16);
+  }
+
+  TEST_CASE("binary reader")
+  {
+    std::string data(3*MEM_CHUNK, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) data[i] = char(i);
+    std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), data.size());
+
+    auto mem = Source::FromMemory(data);
+    std::string fallback;
+    {
+      BinaryReader rd{mem, 1, 16, fallback};
+      CHECK(rd.ReadUint8(Endian::LITTLE) == 1);
+      CHECK(rd.ReadLittleUint16() == 0x0302);
+      CHECK(rd.ReadBigUint32() == 0x04050607);
+      CHECK(rd.ReadUint64(Endian::BIG) == 0x08090a0b0c0d0e0f);
+      CHECK(rd.Tell() == 16);
+      CHECK(rd.GetRemainingSize() == 1);
+      CHECK_THROWS_AS(rd.ReadLittleUint16<Libshit::Check::Throw>(),
+                      SourceOverflow);
+
+      rd.Seek(2);
+      CHECK(rd.ReadView(2).data() == mem.GetChunk(2).data()); // no copy
+      CHECK(fallback.empty());
+      CHECK_THROWS_AS(rd.Seek<Libshit::Check::Throw>(0), SourceOverflow);
+    }
+    CHECK_THROWS_AS((BinaryReader{mem, data.size() - 1, 2, fallback}),
+                    SourceOverflow);
+
+    // spans read chunks: copied into fallback
+    Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    Source file{Libshit::MakeSmart<UnixProvider>(
+        Libshit::Move(io), "tmp", data.size())};
+    BinaryReader rd{file, MEM_CHUNK - 2, 4, fallback};
+    CHECK(rd.ReadLittleUint32() == boost::endian::little_to_native(
+            file.PreadGen<std::uint32_t>(MEM_CHUNK - 2)));
+    CHECK(fallback.size() == 4);
+
+    // not stable chunks: copied, other reads can evict the chunk
+    IoSettings settings;
+    settings.cache_slots = 1;
+    Libshit::LowIo io2{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    Source file2{Libshit::MakeSmart<UnixProvider>(
+        Libshit::Move(io2), "tmp", data.size(), settings)};
+    std::string fallback2;
+    BinaryReader rd2{file2, 4, 4, fallback2};
+    CHECK(fallback2.size() == 4);
+    file2.PreadGen<std::uint32_t>(MEM_CHUNK + 4);
+    CHECK(rd2.ReadLittleUint32() == 0x07060504);
+  }
+
+  TEST_CASE("overlay")
+  {
+    auto str = [](const Source& src)
+    {
+      std::string ret(src.GetSize(), '\0');
+      src.Pread(0, ret.data(), ret.size());
+      return ret;
+    };
+
+    std::string data(3*MEM_CHUNK, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) data[i] = char('a' + i % 26);
+    std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), data.size());
+
+    auto mem = Source::FromMemory(data);
+    Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    Source file{Libshit::MakeSmart<UnixProvider>(
+        Libshit::Move(io), "tmp", data.size())};
+
+    for (auto base : {mem, file})
+    {
+      CAPTURE(base.HasStableChunks());
+      auto exp = data;
+      auto src = base.Replace(1, "XY");
+      exp.replace(1, 2, "XY");
+      CHECK(str(src) == exp);
+
+      src = src.Insert(MEM_CHUNK + 3, "inserted");
+      exp.insert(MEM_CHUNK + 3, "inserted");
+      src = src.Replace(src.GetSize() - 2, "!!");
+      exp.replace(exp.size() - 2, 2, "!!");
+      // patch over an earlier patch, spanning into the base
+      src = src.Replace(MEM_CHUNK + 1, "0123456789");
+      exp.replace(MEM_CHUNK + 1, 10, "0123456789");
+      CHECK(src.GetSize() == exp.size());
+      CHECK(str(src) == exp);
+
+      // patching a slice only touches the slice
+      Source sl{src, 2, 100};
+      CHECK(str(sl.Insert(100, "end")) == exp.substr(2, 100) + "end");
+
+      std::string dumped;
+      for (FilePosition offs = 0; offs < src.GetSize(); )
+      {
+        auto c = src.GetChunk(offs);
+        dumped += c;
+        offs += c.size();
+      }
+      CHECK(dumped == exp);
+    }
+
+    // unchanged regions are served without copying from stable sources
+    auto src = mem.Replace(0, "x");
+    CHECK(src.GetChunk(1).data() == mem.GetChunk(1).data());
+    CHECK_THROWS(mem.Replace(data.size() - 1, "xx"));
+    CHECK_THROWS(mem.Insert(data.size() + 1, "x"));
+  }
+
+  TEST_CASE("concat")
+  {
+    auto str = [](const Source& src)
+    {
+      std::string ret(src.GetSize(), '\0');
+      src.Pread(0, ret.data(), ret.size());
+      return ret;
+    };
+
+    std::string data(MEM_CHUNK + 5, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) data[i] = char('a' + i % 26);
+    std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), data.size());
+
+    auto mem = Source::FromMemory("head");
+    auto file = Source::FromFile("tmp");
+    auto src = Source::Concat({mem, Source::FromMemory(""), file, mem});
+    auto exp = "head" + data + "head";
+    CHECK(src.GetSize() == exp.size());
+    CHECK(str(src) == exp);
+
+    // read across the boundary
+    char buf[6];
+    src.Pread(src.GetSize() - 6, buf, 6);
+    CHECK(std::string(buf, 6) == exp.substr(exp.size() - 6));
+
+    // chunks come from the concatenated sources
+    CHECK(src.GetChunk(1).data() == mem.GetChunk(1).data());
+    CHECK(src.GetChunk(0).size() == 4);
+
+    // nested concats are flattened
+    auto nested = Source::Concat({Source{src, 2, 10}, src});
+    CHECK(str(nested) == exp.substr(2, 10) + exp);
+    CHECK(Source::Concat({mem}).GetSize() == 4);
+    CHECK(Source::Concat({}).GetSize() == 0);
+  }
+
+  TEST_CASE("io stats")
+  {
+    std::string data(3*MEM_CHUNK, 'x');
+    std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), data.size());
+
+    auto global_misses = GetIoStats().Get(IoStats::LRU_MISSES);
+    Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    Source src{Libshit::MakeSmart<UnixProvider>(
+        Libshit::Move(io), "tmp", data.size())};
+    auto& stats = src.GetProviderIoStats();
+
+    char buf[16];
+    src.Pread(0, buf, 16);
+    CHECK(stats.Get(IoStats::LRU_MISSES) == 1);
+    CHECK(stats.Get(IoStats::SYSCALLS) == 1);
+    src.Pread(16, buf, 16);
+    CHECK(stats.Get(IoStats::LRU_HITS) == 1);
+    CHECK(stats.Get(IoStats::BYTES_COPIED) == 32);
+    CHECK(GetIoStats().Get(IoStats::LRU_MISSES) >= global_misses + 1);
+
+    auto chunk = src.GetChunk(0);
+    CHECK(stats.Get(IoStats::BYTES_ZERO_COPY) == chunk.size());
+    CHECK(stats.Get(IoStats::LRU_HITS) == 2);
+
+    // counters of destroyed providers are kept
+    std::uint64_t zero_copy;
+    {
+      auto tmp = Source::FromMemory("abc");
+      tmp.GetChunk(0);
+      zero_copy = GetIoStats().Get(IoStats::BYTES_ZERO_COPY);
+    }
+    CHECK(GetIoStats().Get(IoStats::BYTES_ZERO_COPY) >= zero_copy);
+  }
+
+  TEST_CASE("dump file to file")
+  {
+    std::string data(1024*1024, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i)
+      data[i] = char(i * 7 + i / 251);
+    std::ofstream{"tmp_in", std::ios_base::binary}.write(
+      data.data(), data.size());
+
+    auto file = Source::FromFile("tmp_in");
+    auto src = file.Insert(300000, "patch");
+    auto exp = data;
+    exp.insert(300000, "patch");
+    Source{src, 1000, exp.size() - 2000}.Dump(
+      *Sink::ToFile("tmp", exp.size() - 2000, false));
+
+    std::string act(exp.size() - 2000, '\0');
+    std::ifstream is{"tmp", std::ios_base::binary};
+    is.read(act.data(), act.size());
+    REQUIRE(is.good());
+    CHECK(act == exp.substr(1000, exp.size() - 2000));
+    is.get();
+    CHECK(is.eof());
+
+#ifdef __linux__
+    // both sides of the patch were copied by the kernel
+    CHECK(file.GetProviderIoStats().Get(IoStats::BYTES_KERNEL_COPY) ==
+          data.size() - 2000);
+#endif
+  }
+
+  TEST_CASE("sequential prefetch")
+  {
+    static constexpr FilePosition SIZE = 64*1024 + 123;
+    std::string data(SIZE, '\0');
+    for (FilePosition i = 0; i < SIZE; ++i) data[i] = char(i * 13);
+    std::ofstream{"tmp", std::ios_base::binary}.write(data.data(), SIZE);
+
+    Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    Source src{Libshit::MakeSmart<UnixProvider>(Libshit::Move(io), "tmp", SIZE)};
+
+    SUBCASE("explicit") { src.Prefetch(MEM_CHUNK * 3, 100); }
+    SUBCASE("out of range") { src.Prefetch(SIZE + 10, 100); }
+    SUBCASE("auto") {}
+
+    std::string read(SIZE, '\0');
+    for (FilePosition i = 0; i < SIZE; i += 100)
+      src.Pread(i, read.data() + i, std::min<FilePosition>(100, SIZE - i));
+    CHECK(read == data);
+  }
+
+  TEST_CASE("thread safe nesting")
+  {
+    std::ofstream{"tmp", std::ios_base::binary} << "abcdef";
+    Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    Libshit::SmartPtr<Source::Provider> p =
+      Libshit::MakeSmart<UnixProvider>(Libshit::Move(io), "tmp", 6);
+    Source base{Libshit::MakeNotNull(p)};
+    auto ov = base.Insert(3, "xyz");
+
+    char buf[9];
+    auto read = [&]() { ov.Pread(0, buf, 9); };
+
+    ov.SetThreadSafe(true);
+    CHECK(p->IsThreadSafe()); // through the overlay
+    base.SetThreadSafe(true);
+    std::thread{read}.join();
+    CHECK(std::string_view{buf, 9} == "abcxyzdef");
+    ov.SetThreadSafe(false);
+    CHECK(p->IsThreadSafe());
+    std::thread{read}.join();
+    base.SetThreadSafe(false);
+    CHECK(!p->IsThreadSafe());
+    std::memset(buf, 0, 9);
+    read();
+    CHECK(std::string_view{buf, 9} == "abcxyzdef");
+  }
+
+  TEST_CASE("parallel reads")
+  {
+    static constexpr FilePosition SIZE = 4*1024*1024;
+    static constexpr unsigned THREADS = 8;
+    std::unique_ptr<Byte[]> exp{new Byte[SIZE]};
+    for (FilePosition i = 0; i < SIZE; ++i)
+      exp[i] = static_cast<Byte>(i * 7 + i / 251);
+    {
+      std::ofstream os{"tmp", std::ios_base::binary};
+      os.write(reinterpret_cast<char*>(exp.get()), SIZE);
+    }
+
+    Libshit::SmartPtr<Source::Provider> p;
+    Libshit::LowIo io{"tmp", Libshit::LowIo::Permission::READ_ONLY,
+      Libshit::LowIo::Mode::OPEN_ONLY};
+    SUBCASE("mmap")
+    { p = Libshit::MakeSmart<MmapProvider>(Libshit::Move(io), "tmp", SIZE); }
+    SUBCASE("mmap windowed")
+    {
+      auto& settings = GetIoSettings();
+      auto old_limit = settings.whole_file_limit;
+      settings.whole_file_limit = 0;
+      p = Libshit::MakeSmart<MmapProvider>(Libshit::Move(io), "tmp", SIZE);
+      settings.whole_file_limit = old_limit;
+    }
+    SUBCASE("unix")
+    { p = Libshit::MakeSmart<UnixProvider>(Libshit::Move(io), "tmp", SIZE); }
+    SUBCASE("memory")
+    {
+      p = Libshit::MakeSmart<StringProvider>(
+        "tmp", std::string{reinterpret_cast<char*>(exp.get()), SIZE});
+    }
+    Source src{Libshit::MakeNotNull(Libshit::Move(p))};
+    src.SetThreadSafe();
+
+    std::atomic<unsigned> errors{0};
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < THREADS; ++t)
+      threads.emplace_back([&, t]()
+      {
+        std::mt19937_64 rnd{t};
+        Byte buf[1024];
+        for (int i = 0; i < 20000; ++i)
+        {
+          FilePosition offs = rnd() % SIZE;
+          if (i & 1)
+          {
+            auto len = std::min<FilePosition>(rnd() % sizeof(buf), SIZE-offs);
+            src.Pread(offs, buf, len);
+            if (memcmp(buf, exp.get() + offs, len)) ++errors;
+          }
+          else
+          {
+            auto chunk = src.GetChunk(offs);
+            if (memcmp(chunk.data(), exp.get() + offs, chunk.size())) ++errors;
+          }
+        }
+      });
+    for (auto& t : threads) t.join();
+
+    CHECK(errors == 0);
+  }
   TEST_SUITE_END();
 }
 
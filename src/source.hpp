@@ -13,16 +13,110 @@
 #include <libshit/shared_ptr.hpp>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/intrusive/list_hook.hpp>
 
 #include <array>
+#include <atomic>
 #include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <mutex>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 namespace Neptools
 {
 
   LIBSHIT_GEN_EXCEPTION_TYPE(SourceOverflow, std::logic_error);
 
+  enum class AccessPattern { NORMAL, SEQUENTIAL, RANDOM };
+
+  /// Runtime I/O tunables. Changes of source settings only affect sources
+  /// opened afterwards.
+  struct IoSettings
+  {
+    /// Files not larger than this are mapped as a whole. By default only
+    /// limited when the address space is small.
+    FilePosition whole_file_limit =
+      sizeof(void*) >= 8 ? FilePosition(-1) : MMAP_LIMIT;
+    /// Window size used when the file is not mapped as a whole. Must be a
+    /// multiple of 64KiB (allocation granularity on windows).
+    FileMemSize chunk_size = MMAP_CHUNK;
+    /// Chunk size of files read without mmap.
+    FileMemSize read_chunk_size = MEM_CHUNK;
+    /// Number of chunks (mmap windows or read buffers) a provider keeps, per
+    /// thread in thread safe mode.
+    std::size_t cache_slots = 4;
+    /// Default access pattern hint given to the OS.
+    AccessPattern access = AccessPattern::NORMAL;
+    /// Ask the OS to read whole file mappings in advance.
+    bool populate = false;
+    /// Threads used to dump independent parts of a file (like cl3 entries).
+    /// 0: number of CPUs.
+    unsigned dump_jobs = 0;
+    /// Don't rewrite output files that would stay the same.
+    bool write_if_changed = false;
+    /// Write output files from a background thread, while the next buffer is
+    /// filled. Disables mmap, writev and parallel dumps.
+    bool write_behind = false;
+    /// Size of one write behind buffer (two are used).
+    FileMemSize write_buffer_size = 1024*1024;
+  };
+  IoSettings& GetIoSettings() noexcept;
+
+  /// Restores GetIoSettings to its value at construction when destroyed.
+  class IoSettingsGuard
+  {
+  public:
+    IoSettingsGuard() : saved{GetIoSettings()} {}
+    ~IoSettingsGuard() { GetIoSettings() = saved; }
+    IoSettingsGuard(const IoSettingsGuard&) = delete;
+    void operator=(const IoSettingsGuard&) = delete;
+
+  private:
+    IoSettings saved;
+  };
+
+  /// I/O counters of source providers. Every provider only updates its own,
+  /// the process-wide numbers are summed by GetIoStats when asked.
+  struct IoStats
+  {
+    enum Counter
+    {
+      LRU_HITS,        ///< Source lookups served from the LRU
+      LRU_MISSES,      ///< Source lookups that had to ask the provider
+      MAPS,            ///< mmap windows created
+      UNMAPS,          ///< mmap windows released
+      SYSCALLS,        ///< read, map and unmap calls (hints not included)
+      BYTES_COPIED,    ///< bytes memcpy'd or read into a caller's buffer
+      BYTES_ZERO_COPY, ///< bytes handed out as views into provider memory
+      BYTES_KERNEL_COPY, ///< bytes copied into a file sink by the kernel
+      COUNTER_COUNT
+    };
+    static const char* const NAMES[COUNTER_COUNT];
+
+    IoStats() = default;
+    /// Snapshot of o's counters.
+    IoStats(const IoStats& o) noexcept { Add(o); }
+    void operator=(const IoStats&) = delete;
+
+    std::uint64_t Get(Counter c) const noexcept
+    { return counters[c].load(std::memory_order_relaxed); }
+    void Add(Counter c, std::uint64_t n) noexcept
+    { counters[c].fetch_add(n, std::memory_order_relaxed); }
+    void Add(const IoStats& o) noexcept;
+    void Reset() noexcept;
+
+    /// Human readable report, one counter per line.
+    void Print(std::ostream& os) const;
+
+  private:
+    std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> counters{};
+  };
+  /// Sum of the counters of every provider, including destroyed ones.
+  IoStats GetIoStats();
+
   /// A fixed size, read-only, seekable data source (or something that emulates
   /// it)
   class LIBSHIT_LUAGEN(const=false) Source final
@@ -40,10 +134,15 @@ namespace Neptools
     Source(Source s, FilePosition offset, FilePosition size) noexcept
       : Source{std::move(s)} { Slice(offset, size); get = 0; }
 
-    static Source FromFile(const boost::filesystem::path& fname);
+    static Source FromFile(const boost::filesystem::path& fname)
+    { return FromFile(fname, GetIoSettings()); }
+    /// Open with non default chunk/cache settings.
+    LIBSHIT_NOLUA static Source FromFile(
+      const boost::filesystem::path& fname, const IoSettings& settings);
     LIBSHIT_NOLUA
     static Source FromFd(
-      boost::filesystem::path fname, Libshit::LowIo::FdType fd, bool owning);
+      boost::filesystem::path fname, Libshit::LowIo::FdType fd, bool owning,
+      const IoSettings& settings = GetIoSettings());
     static Source FromMemory(std::string data)
     { return FromMemory("", std::move(data)); }
     static Source FromMemory(boost::filesystem::path fname, std::string data);
@@ -61,6 +160,16 @@ namespace Neptools
       this->size = size;
     }
 
+    /// Copy of this source with data written over offs. Copy-on-write: only
+    /// data is stored, the rest is still read from this source.
+    Source Replace(FilePosition offs, std::string data) const;
+    /// Copy of this source with data inserted before offs (copy-on-write).
+    Source Insert(FilePosition offs, std::string data) const;
+
+    /// One source reading srcs after each other (without copying them). The
+    /// file name is the first source's.
+    LIBSHIT_NOLUA static Source Concat(const std::vector<Source>& srcs);
+
     FilePosition GetOffset() const noexcept { return offset; }
     FilePosition GetOrigSize() const noexcept { return p->size; }
     const boost::filesystem::path& GetFileName() const noexcept
@@ -170,22 +279,139 @@ namespace Neptools
     }
     std::string PreadCString(FilePosition offs) const;
 
-    struct Provider : public Libshit::RefCounted
+    /// Get len bytes at offs without copying when they're contiguous in the
+    /// provider's memory. Otherwise they're copied into fallback and a view
+    /// of it is returned. The view is only valid until the next read through
+    /// the same provider (on the same thread) or the modification of
+    /// fallback, whichever comes first.
+    template <typename Checker = Libshit::Check::Assert>
+    LIBSHIT_NOLUA std::string_view GetContiguous(
+      FilePosition offs, FileMemSize len, std::string& fallback) const
+    {
+      LIBSHIT_ADD_INFOS(
+        LIBSHIT_CHECK(SourceOverflow, offs <= size && offs+len <= size,
+                      "Source overflow");
+        return GetContiguous_(offs, len, fallback),
+        "Used source", *this, "Read offset", offs, "Read size", len);
+    }
+    /// Zero terminated string at offs (without the terminator), with the same
+    /// lifetime rules as GetContiguous.
+    LIBSHIT_NOLUA std::string_view PreadCStringView(
+      FilePosition offs, std::string& fallback) const;
+
+    struct Provider : public Libshit::RefCounted,
+                      public boost::intrusive::list_base_hook<>
     {
-      Provider(boost::filesystem::path file_name, FilePosition size)
-        : file_name{std::move(file_name)}, size{size} {}
+      Provider(boost::filesystem::path file_name, FilePosition size);
       Provider(const Provider&) = delete;
       void operator=(const Provider&) = delete;
-      virtual ~Provider() = default;
+      virtual ~Provider() noexcept;
 
       virtual void Pread(FilePosition offs, Byte* buf, FileMemSize len) = 0;
-
-      void LruPush(const Byte* ptr, FilePosition offset, FileMemSize size);
-      bool LruGet(FilePosition offs);
-
-      std::array<BufEntry, 4> lru;
+      virtual void SetAccessPattern(AccessPattern) {}
+      /// Whether chunks returned through the LRU stay valid as long as the
+      /// provider lives (i.e. they're never evicted and freed).
+      virtual bool HasStableChunks() const noexcept { return false; }
+      /// Hint that [offs, offs+len) will be read soon. Must not block.
+      virtual void Prefetch(FilePosition, FilePosition) noexcept {}
+      /// The file containing the data at the same offsets, or nullptr.
+      virtual Libshit::LowIo* GetLowIo() noexcept { return nullptr; }
+
+      /// Most recently used chunks of a provider. Lookup checks the most
+      /// recent entry first, then a hash of chunk aligned entries (when
+      /// chunk_size is set), and only scans the remaining entries linearly.
+      class Lru
+      {
+      public:
+        explicit Lru(std::size_t capacity = 4, FileMemSize chunk_size = 0);
+
+        std::size_t GetCapacity() const noexcept { return nodes.size(); }
+        /// Entry containing offs, which becomes the most recent one.
+        const BufEntry* Get(FilePosition offs) noexcept;
+        /// Add a new most recent entry. Returns the evicted entry (with zero
+        /// size if the LRU wasn't full yet).
+        BufEntry Push(const Byte* ptr, FilePosition offset, FileMemSize size);
+        const BufEntry& Front() const noexcept;
+
+        template <typename Fun> void ForEach(Fun fun) const
+        {
+          for (auto i = head; i != NONE; i = nodes[i].next)
+            fun(nodes[i].entry);
+        }
+
+      private:
+        static constexpr std::uint32_t NONE = -1;
+        struct Node
+        {
+          BufEntry entry;
+          std::uint32_t prev, next;
+        };
+
+        bool IsIndexed(const BufEntry& e) const noexcept;
+        std::size_t Slot(FilePosition key) const noexcept;
+        void IndexAdd(std::uint32_t n) noexcept;
+        void IndexRemove(std::uint32_t n) noexcept;
+        void Unlink(std::uint32_t n) noexcept;
+        void LinkFront(std::uint32_t n) noexcept;
+
+        std::vector<Node> nodes;
+        std::uint32_t head = NONE, tail = NONE, used = 0;
+        std::uint32_t not_indexed = 0;
+        FileMemSize chunk_size;
+        // open addressing, chunk number -> node, NONE if empty
+        std::vector<std::uint32_t> index;
+      };
+
+      /// Switch to per-thread LRU state, so the provider can serve Pread and
+      /// GetChunk calls from multiple threads in parallel (on = true), or back
+      /// to a single LRU. Calls nest: the provider stays thread safe until
+      /// every SetThreadSafe(true) is matched by a SetThreadSafe(false). Must
+      /// only be called while no other thread uses the provider. Entries in
+      /// lru at the switch are shared between every thread and never evicted
+      /// while thread safe. The sources the provider reads from are switched
+      /// too.
+      void SetThreadSafe(bool on = true) noexcept;
+      bool IsThreadSafe() const noexcept { return thread_safe; }
+
+      /// The LRU of the calling thread (or lru when not thread safe)
+      Lru& GetLru();
+      bool IsShared(const BufEntry& e) const noexcept;
+
+      BufEntry LruPush(const Byte* ptr, FilePosition offset, FileMemSize size)
+      { return GetLru().Push(ptr, offset, size); }
+      const BufEntry* LruGet(FilePosition offs) { return GetLru().Get(offs); }
+
+      void Count(IoStats::Counter c, std::uint64_t n = 1) noexcept
+      { stats.Add(c, n); }
+
+      Lru lru;
       boost::filesystem::path file_name;
       FilePosition size;
+      IoStats stats;
+
+    protected:
+      /// SetThreadSafe(on) the sources read by this provider.
+      virtual void SetSourcesThreadSafe(bool) noexcept {}
+      /// Free a chunk evicted from the LRU, called when switching back from
+      /// thread safe mode.
+      virtual void FreeChunk(const BufEntry&) noexcept {}
+
+      /// Call fun on every chunk owned by this provider (i.e. lru and the
+      /// not shared entries of the per-thread LRUs). To be used by destructors.
+      template <typename Fun> void ForEachChunk(Fun fun)
+      {
+        lru.ForEach([&](auto& e) { if (e.size) fun(e); });
+        for (auto& tl : thread_lrus)
+          tl.second.ForEach(
+            [&](auto& e) { if (e.size && !IsShared(e)) fun(e); });
+      }
+
+    private:
+      bool thread_safe = false;
+      unsigned thread_safe_count = 0;
+      std::uint64_t thread_safe_id = 0;
+      std::mutex thread_lrus_mutex;
+      std::map<std::thread::id, Lru> thread_lrus;
     };
     LIBSHIT_NOLUA Source(Libshit::NotNullSmartPtr<Provider> p)
       : size{p->size}, p{Libshit::Move(p)} {}
@@ -198,12 +424,48 @@ namespace Neptools
 
     LIBSHIT_NOLUA std::string_view GetChunk(FilePosition offs) const;
 
+    /// Hint the expected access pattern to the OS (only for mmapped files).
+    /// Affects every Source sharing the provider.
+    LIBSHIT_NOLUA void SetAccessPattern(AccessPattern pat)
+    { p->SetAccessPattern(pat); }
+
+    /// Hint that [offs, offs+len) of this source will be read soon, so the
+    /// provider can start reading it in the background. Out of range parts
+    /// are ignored.
+    LIBSHIT_NOLUA void Prefetch(FilePosition offs, FilePosition len) const noexcept
+    {
+      if (offs >= size) return;
+      p->Prefetch(offset + offs, std::min(len, size - offs));
+    }
+
+    /// See Provider::SetThreadSafe. Affects every Source sharing the provider.
+    LIBSHIT_NOLUA void SetThreadSafe(bool on = true) const noexcept
+    { p->SetThreadSafe(on); }
+
+    LIBSHIT_NOLUA bool HasStableChunks() const noexcept
+    { return p->HasStableChunks(); }
+
+    /// Counters of the underlying provider (shared with other Sources).
+    LIBSHIT_NOLUA const IoStats& GetProviderIoStats() const noexcept
+    { return p->stats; }
+
   private:
     // offset: in original file!
     BufEntry GetTemporaryEntry(FilePosition offs) const;
+    // GetChunk without counting the view as handed out
+    std::string_view GetChunk_(FilePosition offs) const;
 
     void Pread_(FilePosition offs, Byte* buf, FileMemSize len) const;
-    static Source FromFile_(const boost::filesystem::path& fname);
+    std::string_view GetContiguous_(
+      FilePosition offs, FileMemSize len, std::string& fallback) const;
+    static Source FromFile_(
+      const boost::filesystem::path& fname, const IoSettings& settings);
+    Source Splice_(FilePosition offs, FilePosition remove, std::string data) const;
+    // dump a non-overlay source
+    void DumpPiece_(Sink& sink) const;
+    // call fun with slices of non-overlay sources making up [beg, end)
+    template <typename Fun>
+    void ForEachPiece_(FilePosition beg, FilePosition end, Fun&& fun) const;
 
     FilePosition offset = 0, size, get = 0;
 
@@ -228,6 +490,9 @@ namespace Neptools
     void Fixup() override {}
 
     FilePosition GetSize() const override { return src.GetSize(); }
+    LIBSHIT_NOLUA bool CanDumpParallel() const override { return true; }
+    LIBSHIT_NOLUA void SetThreadSafe(bool on) const noexcept override
+    { src.SetThreadSafe(on); }
     Source GetSource() const noexcept { return src; }
   private:
     Source src;
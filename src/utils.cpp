@@ -1,5 +1,6 @@
 #include "utils.hpp"
 #include <libshit/char_utils.hpp>
+#include <libshit/options.hpp>
 
 #include "source.hpp"
 #include <fstream>
@@ -14,6 +15,13 @@
 namespace Neptools
 {
 
+  Libshit::OptionGroup& GetIoOptions()
+  {
+    static Libshit::OptionGroup grp{
+      Libshit::OptionParser::GetGlobal(), "I/O options"};
+    return grp;
+  }
+
   std::ofstream OpenOut(const boost::filesystem::path& pth)
   {
     std::ofstream os;
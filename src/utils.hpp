@@ -8,6 +8,8 @@
 #include <cstdlib>
 #include <iosfwd>
 
+namespace Libshit { class OptionGroup; }
+
 namespace Neptools
 {
   class Source; // fwd
@@ -21,6 +23,9 @@ namespace Neptools
   static constexpr const std::size_t MMAP_CHUNK = 128*1024; // 128KiB
   static constexpr const std::size_t MMAP_LIMIT = 1*1024*1024; // 1MiB
 
+  /// Command line options controlling low level file I/O
+  Libshit::OptionGroup& GetIoOptions();
+
   std::ofstream OpenOut(const boost::filesystem::path& pth);
   std::ifstream OpenIn(const boost::filesystem::path& pth);
 
@@ -62,8 +62,7 @@ namespace Neptools
 
   CpkSource::~CpkSource()
   {
-    for (auto& e : lru)
-      delete[] e.ptr;
+    lru.ForEach([](auto& e) { delete[] e.ptr; });
     cpk->OrigCloseFile(index);
   }
 
@@ -96,8 +95,9 @@ namespace Neptools
       auto to_offs = offs % CPK_CHUNK;
       auto to_copy = std::min<FilePosition>(len, csize - to_offs);
       memcpy(buf, cbuf.get() + to_offs, to_copy);
-      delete[] lru[lru.size()-1].ptr;
-      LruPush(reinterpret_cast<Byte*>(cbuf.release()), offs, csize);
+      auto evicted = LruPush(
+        reinterpret_cast<Byte*>(cbuf.release()), offs, csize);
+      delete[] evicted.ptr;
 
       buf += to_copy;
       offs += to_copy;
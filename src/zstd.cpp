@@ -0,0 +1,456 @@
+#include "zstd.hpp"
+
+#include <libshit/assert.hpp>
+#include <libshit/except.hpp>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/endian/arithmetic.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#if NEPTOOLS_WITH_ZSTD
+#  include <zstd.h>
+#endif
+
+#include <libshit/doctest.hpp>
+
+#define LIBSHIT_LOG_NAME "zstd"
+#include <libshit/logger_helper.hpp>
+
+namespace Neptools
+{
+  TEST_SUITE_BEGIN("Neptools::Zstd");
+
+  static constexpr std::uint32_t ZSTD_MAGIC = 0xfd2fb528;
+
+  bool IsZstd(const Source& src)
+  {
+    return src.GetSize() >= 4 && src.PreadLittleUint32(0) == ZSTD_MAGIC;
+  }
+
+  // case insensitive, like the extension checks of stcm-editor
+  bool IsZstdPath(const boost::filesystem::path& fname)
+  { return boost::iends_with(fname.native(), ".zst"); }
+
+  Source MaybeDecompressZstd(Source src)
+  {
+    if (!IsZstd(src)) return src;
+    auto fname = src.GetFileName();
+    return DecompressZstd(src, Libshit::Move(fname));
+  }
+
+#if NEPTOOLS_WITH_ZSTD
+  // seekable format: the seek table is a skippable frame at the end
+  static constexpr std::uint32_t SKIPPABLE_MAGIC = 0x184d2a5e;
+  static constexpr std::uint32_t SEEKABLE_MAGIC = 0x8f92eab1;
+  static constexpr FileMemSize SEEK_FOOTER_SIZE = 9;
+
+  namespace
+  {
+    struct Frame
+    {
+      FilePosition comp_offset; // in the compressed source
+      FileMemSize comp_size;
+      FilePosition offset; // in the decompressed data
+      FileMemSize size;
+    };
+
+    // every frame is one LRU chunk, decompressed on a miss
+    struct ZstdProvider final : public Source::Provider
+    {
+      ZstdProvider(Source src, boost::filesystem::path file_name,
+                   std::vector<Frame> frames, FilePosition size)
+        : Source::Provider{Libshit::Move(file_name), size},
+          src{Libshit::Move(src)}, frames{Libshit::Move(frames)}
+      { lru = Lru{GetIoSettings().cache_slots}; }
+      ~ZstdProvider() noexcept override;
+
+      void Pread(FilePosition offs, Byte* buf, FileMemSize len) override;
+      void SetSourcesThreadSafe(bool on) noexcept override
+      { src.SetThreadSafe(on); }
+      void FreeChunk(const Source::BufEntry& e) noexcept override
+      { delete[] e.ptr; }
+      const Source::BufEntry& EnsureFrame(FilePosition offs);
+
+      Source src;
+      std::mutex src_mutex; // src may be shared with the caller's thread
+      std::vector<Frame> frames;
+    };
+
+    struct CCtxDeleter
+    { void operator()(ZSTD_CCtx* ctx) const noexcept { ZSTD_freeCCtx(ctx); } };
+
+    // compresses into out in frames of FRAME_SIZE, writes the seek table at
+    // the end
+    struct LIBSHIT_NOLUA ZstdSink final : public Sink
+    {
+      ZstdSink(Libshit::NotNull<Libshit::RefCountedPtr<Sink>> out,
+               FilePosition size);
+      ~ZstdSink() override;
+
+      void Write_(std::string_view data) override;
+      void Pad_(FileMemSize len) override;
+      void Finish() override;
+
+      void CompressFrame();
+
+      static constexpr FileMemSize FRAME_SIZE = 1024*1024;
+      static constexpr int LEVEL = 9;
+
+      Libshit::NotNull<Libshit::RefCountedPtr<Sink>> out;
+      std::unique_ptr<ZSTD_CCtx, CCtxDeleter> cctx;
+      std::unique_ptr<Byte[]> frame_buf, comp_buf;
+      std::vector<std::pair<std::uint32_t, std::uint32_t>> table; // comp, size
+      bool finished = false;
+    };
+  }
+
+  static void CheckZstd(std::size_t res, const char* msg)
+  {
+    if (ZSTD_isError(res))
+      LIBSHIT_THROW(Libshit::DecodeError, msg,
+                    "Zstd error", ZSTD_getErrorName(res));
+  }
+
+  ZstdProvider::~ZstdProvider() noexcept
+  {
+    ForEachChunk([](auto& e) { delete[] e.ptr; });
+  }
+
+  const Source::BufEntry& ZstdProvider::EnsureFrame(FilePosition offs)
+  {
+    auto& lru = GetLru();
+    if (auto e = lru.Get(offs)) return *e;
+
+    auto it = std::upper_bound(
+      frames.begin(), frames.end(), offs,
+      [](FilePosition o, const Frame& f) { return o < f.offset; });
+    LIBSHIT_ASSERT(it != frames.begin());
+    auto& f = *--it;
+
+    std::unique_ptr<Byte[]> out{new Byte[f.size]};
+    {
+      std::lock_guard lock{src_mutex};
+      std::string fallback;
+      auto in = src.GetContiguous(f.comp_offset, f.comp_size, fallback);
+      auto res = ZSTD_decompress(out.get(), f.size, in.data(), in.size());
+      ADD_SOURCE(CheckZstd(res, "Zstd: decompression failed"), src);
+      if (res != f.size)
+        LIBSHIT_THROW(Libshit::DecodeError, "Zstd: invalid frame size",
+                      "Used source", src, "Frame offset", f.comp_offset);
+    }
+    Count(IoStats::BYTES_COPIED, f.size);
+
+    auto evicted = lru.Push(out.release(), f.offset, f.size);
+    // shared entries belong to every thread, only the destructor frees them
+    if (evicted.size && !IsShared(evicted)) delete[] evicted.ptr;
+    return lru.Front();
+  }
+
+  void ZstdProvider::Pread(FilePosition offs, Byte* buf, FileMemSize len)
+  {
+    if (len == 0) EnsureFrame(offs);
+    while (len)
+    {
+      auto& e = EnsureFrame(offs);
+      auto buf_offs = offs - e.offset;
+      auto to_cpy = std::min<FilePosition>(len, e.size - buf_offs);
+      memcpy(buf, e.ptr + buf_offs, to_cpy);
+      Count(IoStats::BYTES_COPIED, to_cpy);
+      buf += to_cpy;
+      offs += to_cpy;
+      len -= to_cpy;
+    }
+  }
+
+  // returns false if src has no seek table
+  static bool ReadSeekTable(const Source& src, std::vector<Frame>& frames)
+  {
+    auto size = src.GetSize();
+    if (size < 8 + SEEK_FOOTER_SIZE) return false;
+    if (src.PreadLittleUint32(size - 4) != SEEKABLE_MAGIC) return false;
+
+    auto n = src.PreadLittleUint32(size - SEEK_FOOTER_SIZE);
+    auto desc = src.PreadLittleUint8(size - 5);
+    FilePosition entry_size = (desc & 0x80) ? 12 : 8; // with checksums
+    FilePosition table_size = n * entry_size + SEEK_FOOTER_SIZE;
+    if (size < 8 + table_size ||
+        src.PreadLittleUint32(size - table_size - 8) != SKIPPABLE_MAGIC ||
+        src.PreadLittleUint32(size - table_size - 4) != table_size)
+      LIBSHIT_THROW(Libshit::DecodeError, "Zstd: invalid seek table",
+                    "Used source", src);
+
+    FilePosition comp_offset = 0, offset = 0;
+    auto entry = size - table_size - 8;
+    frames.reserve(n);
+    for (std::uint32_t i = 0; i < n; ++i, entry += entry_size)
+    {
+      FileMemSize comp_size = src.PreadLittleUint32(entry);
+      FileMemSize frame_size = src.PreadLittleUint32(entry + 4);
+      if (frame_size)
+        frames.push_back({comp_offset, comp_size, offset, frame_size});
+      comp_offset += comp_size;
+      offset += frame_size;
+    }
+    if (comp_offset != size - table_size - 8)
+      LIBSHIT_THROW(Libshit::DecodeError, "Zstd: invalid seek table sizes",
+                    "Used source", src);
+    return true;
+  }
+
+  // Frame sizes from the frame headers. Returns false if a frame doesn't
+  // store its size.
+  static bool ReadFrameHeaders(std::string_view in, std::vector<Frame>& frames)
+  {
+    FilePosition offset = 0;
+    for (std::size_t pos = 0; pos < in.size(); )
+    {
+      auto rest = in.substr(pos);
+      auto comp_size = ZSTD_findFrameCompressedSize(rest.data(), rest.size());
+      CheckZstd(comp_size, "Zstd: invalid frame");
+      auto size = ZSTD_getFrameContentSize(rest.data(), rest.size());
+      if (size == ZSTD_CONTENTSIZE_ERROR)
+        LIBSHIT_THROW(Libshit::DecodeError, "Zstd: invalid frame header");
+      if (size == ZSTD_CONTENTSIZE_UNKNOWN) return false;
+
+      // skippable frames have zero size
+      if (size)
+        frames.push_back({pos, comp_size, offset, FileMemSize(size)});
+      offset += size;
+      pos += comp_size;
+    }
+    return true;
+  }
+
+  static Source DecompressWhole(
+    std::string_view in, boost::filesystem::path fname)
+  {
+    std::unique_ptr<ZSTD_DStream, std::size_t (*)(ZSTD_DStream*)> ds{
+      ZSTD_createDStream(), ZSTD_freeDStream};
+    if (!ds) throw std::bad_alloc{};
+
+    std::string out;
+    ZSTD_inBuffer ib{in.data(), in.size(), 0};
+    while (ib.pos < ib.size)
+    {
+      auto done = out.size();
+      out.resize(done + ZSTD_DStreamOutSize());
+      ZSTD_outBuffer ob{out.data() + done, out.size() - done, 0};
+      CheckZstd(ZSTD_decompressStream(ds.get(), &ob, &ib),
+                "Zstd: decompression failed");
+      out.resize(done + ob.pos);
+    }
+    return Source::FromMemory(Libshit::Move(fname), Libshit::Move(out));
+  }
+
+  Source DecompressZstd(const Source& src, boost::filesystem::path fname)
+  {
+    if (!IsZstd(src))
+      LIBSHIT_THROW(Libshit::DecodeError, "Zstd: invalid magic",
+                    "Used source", src);
+
+    std::vector<Frame> frames;
+    if (!ReadSeekTable(src, frames))
+    {
+      std::string fallback;
+      auto in = src.GetContiguous(0, src.GetSize(), fallback);
+      bool sizes_known;
+      ADD_SOURCE(sizes_known = ReadFrameHeaders(in, frames), src);
+      if (!sizes_known)
+        ADD_SOURCE(return DecompressWhole(in, Libshit::Move(fname)), src);
+    }
+
+    // EnsureFrame needs at least one frame
+    if (frames.empty()) return Source::FromMemory(Libshit::Move(fname), "");
+    auto size = frames.back().offset + frames.back().size;
+    return {Libshit::MakeSmart<ZstdProvider>(
+        src, Libshit::Move(fname), Libshit::Move(frames), size)};
+  }
+
+
+  ZstdSink::ZstdSink(
+    Libshit::NotNull<Libshit::RefCountedPtr<Sink>> out, FilePosition size)
+    : Sink{size}, out{Libshit::Move(out)}, cctx{ZSTD_createCCtx()},
+      frame_buf{new Byte[FRAME_SIZE]},
+      comp_buf{new Byte[ZSTD_compressBound(FRAME_SIZE)]}
+  {
+    if (!cctx) throw std::bad_alloc{};
+    buf = frame_buf.get();
+    buf_size = FRAME_SIZE;
+  }
+
+  ZstdSink::~ZstdSink()
+  {
+    try { Finish(); }
+    catch (std::exception& e)
+    {
+      ERR << "~ZstdSink "
+          << Libshit::PrintException(Libshit::Logger::HasAnsiColor())
+          << std::endl;
+    }
+  }
+
+  void ZstdSink::CompressFrame()
+  {
+    if (!buf_put) return;
+    auto res = ZSTD_compressCCtx(
+      cctx.get(), comp_buf.get(), ZSTD_compressBound(FRAME_SIZE),
+      buf, buf_put, LEVEL);
+    CheckZstd(res, "Zstd: compression failed");
+    out->Write({reinterpret_cast<char*>(comp_buf.get()), res});
+    table.emplace_back(std::uint32_t(res), std::uint32_t(buf_put));
+    offset += buf_put;
+    buf_put = 0;
+  }
+
+  void ZstdSink::Finish()
+  {
+    if (finished) return;
+    CompressFrame();
+
+    auto n = static_cast<std::uint32_t>(table.size());
+    out->WriteLittleUint32(SKIPPABLE_MAGIC);
+    out->WriteLittleUint32(std::uint32_t(n * 8 + SEEK_FOOTER_SIZE));
+    for (const auto& [comp, size] : table)
+    {
+      out->WriteLittleUint32(comp);
+      out->WriteLittleUint32(size);
+    }
+    out->WriteLittleUint32(n);
+    out->WriteLittleUint8(0); // no checksums
+    out->WriteLittleUint32(SEEKABLE_MAGIC);
+    finished = true;
+    out->Finish();
+  }
+
+  void ZstdSink::Write_(std::string_view data)
+  {
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    while (!data.empty())
+    {
+      CompressFrame();
+      auto cp = std::min<FileMemSize>(data.size(), buf_size);
+      memcpy(buf, data.data(), cp);
+      buf_put = cp;
+      data.remove_prefix(cp);
+    }
+  }
+
+  void ZstdSink::Pad_(FileMemSize len)
+  {
+    LIBSHIT_ASSERT(buf_put == buf_size);
+    while (len)
+    {
+      CompressFrame();
+      auto cp = std::min<FileMemSize>(len, buf_size);
+      memset(buf, 0, cp);
+      buf_put = cp;
+      len -= cp;
+    }
+  }
+
+  Libshit::NotNull<Libshit::RefCountedPtr<Sink>> CompressZstd(
+    Libshit::NotNull<Libshit::RefCountedPtr<Sink>> out, FilePosition size)
+  { return Libshit::MakeRefCounted<ZstdSink>(Libshit::Move(out), size); }
+
+#else
+
+  Source DecompressZstd(const Source& src, boost::filesystem::path)
+  {
+    LIBSHIT_THROW(Libshit::DecodeError, "Built without zstd support",
+                  "Used source", src);
+  }
+
+  Libshit::NotNull<Libshit::RefCountedPtr<Sink>> CompressZstd(
+    Libshit::NotNull<Libshit::RefCountedPtr<Sink>>, FilePosition)
+  { LIBSHIT_THROW(std::runtime_error, "Built without zstd support"); }
+
+#endif
+
+  TEST_CASE("magic")
+  {
+    CHECK(IsZstd(Source::FromMemory(std::string{"\x28\xb5\x2f\xfd\0", 5})));
+    CHECK(!IsZstd(Source::FromMemory("\x28\xb5\x2f")));
+    CHECK(!IsZstd(Source::FromMemory("CL3L")));
+    CHECK(IsZstdPath("foo/bar.cl3.zst"));
+    CHECK(IsZstdPath("foo/BAR.CL3.ZST"));
+    CHECK(!IsZstdPath("foo/bar.cl3"));
+  }
+
+#if NEPTOOLS_WITH_ZSTD
+  TEST_CASE("seekable round trip")
+  {
+    std::string data(3*1024*1024 + 1234, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i)
+      data[i] = char((i / 7) ^ (i >> 12));
+
+    auto mem = Libshit::MakeRefCounted<MemorySink>();
+    {
+      auto sink = CompressZstd(mem, data.size());
+      sink->Write(data.substr(0, 1000));
+      sink->Pad(5000);
+      sink->Write(data.substr(6000));
+      sink->Finish();
+    }
+    std::fill(data.begin() + 1000, data.begin() + 6000, '\0');
+    auto comp = std::string{mem->GetStringView()};
+    CHECK(comp.size() < data.size() / 2);
+
+    auto src = DecompressZstd(Source::FromMemory(comp));
+    REQUIRE(src.GetSize() == data.size());
+    // read backwards over frame boundaries
+    std::string buf(4096, '\0');
+    for (FilePosition offs = data.size() - 4096; ; offs -= 300000)
+    {
+      src.Pread(offs, buf.data(), buf.size());
+      CHECK(buf == data.substr(offs, 4096));
+      if (offs < 300000) break;
+    }
+  }
+
+  TEST_CASE("plain zstd")
+  {
+    std::string data(100000, 'x');
+    for (std::size_t i = 0; i < data.size(); i += 13) data[i] = char(i);
+    std::string comp(ZSTD_compressBound(data.size()), '\0');
+    comp.resize(ZSTD_compress(
+      comp.data(), comp.size(), data.data(), data.size(), 1));
+
+    auto src = MaybeDecompressZstd(Source::FromMemory(comp));
+    REQUIRE(src.GetSize() == data.size());
+    std::string act(data.size(), '\0');
+    src.Pread(0, act.data(), act.size());
+    CHECK(act == data);
+
+    CHECK(MaybeDecompressZstd(Source::FromMemory("abcd")).GetSize() == 4);
+  }
+
+  TEST_CASE("empty zstd")
+  {
+    std::string comp(ZSTD_compressBound(0), '\0');
+    comp.resize(ZSTD_compress(comp.data(), comp.size(), "", 0, 1));
+    CHECK(DecompressZstd(Source::FromMemory(comp)).GetSize() == 0);
+  }
+
+  TEST_CASE("dump to .zst")
+  {
+    std::string data(300000, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) data[i] = char(i % 97);
+    DumpableSource{Source::FromMemory(data)}.Dump("tmp.zst");
+
+    auto src = MaybeDecompressZstd(Source::FromFile("tmp.zst"));
+    REQUIRE(src.GetSize() == data.size());
+    std::string act(data.size(), '\0');
+    src.Pread(0, act.data(), act.size());
+    CHECK(act == data);
+  }
+#endif
+
+  TEST_SUITE_END();
+}
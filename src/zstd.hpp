@@ -0,0 +1,36 @@
+#ifndef UUID_33016DAD_819A_410B_882F_665E84DBAD4A
+#define UUID_33016DAD_819A_410B_882F_665E84DBAD4A
+#pragma once
+
+#include "sink.hpp"
+#include "source.hpp"
+
+#include <libshit/shared_ptr.hpp>
+
+#include <boost/filesystem/path.hpp>
+
+namespace Neptools
+{
+
+  /// Whether src starts with a zstd frame.
+  bool IsZstd(const Source& src);
+  /// Whether fname has a .zst extension (output there should be compressed).
+  bool IsZstdPath(const boost::filesystem::path& fname);
+
+  /// Source of zstd compressed data. Files in the seekable format (with a seek
+  /// table at the end, like the ones written by CompressZstd) are decompressed
+  /// one frame at a time on access, other files frame by frame or as a whole
+  /// if the frame sizes are not known. Throws if built without zstd.
+  Source DecompressZstd(const Source& src, boost::filesystem::path fname = {});
+  /// DecompressZstd if src is compressed, src otherwise.
+  Source MaybeDecompressZstd(Source src);
+
+  /// Sink compressing into out in the zstd seekable format. size is the
+  /// uncompressed size, out should be a sink of unknown size. Data is only
+  /// written to out when a frame is full and when the sink is destroyed.
+  Libshit::NotNull<Libshit::RefCountedPtr<Sink>> CompressZstd(
+    Libshit::NotNull<Libshit::RefCountedPtr<Sink>> out, FilePosition size);
+
+}
+
+#endif